@@ -1,11 +1,20 @@
 // A C99+ library for creating hierarchically sorted file lists.
 // Copyright (c) 2022 hippie68 (https://github.com/hippie68/file-list)
 
+#ifdef __linux__
+#define _GNU_SOURCE // For statx().
+#endif
+
 #include "file_list.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#ifndef FL_NO_THREADS
+#include <pthread.h>
+#endif
 #ifdef FL_NO_DTYPE
 #include <limits.h>
 #endif
@@ -15,7 +24,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#ifndef FL_NO_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#endif
+#ifndef FL_NO_INOTIFY
+#include <sys/inotify.h>
+#endif
+#endif
+#include <unistd.h>
 
 #define DIR_SEPARATOR '/'
 
@@ -44,7 +67,7 @@ static int strcmp_default(const char *s1, const char *s2)
 
     int temp_ret = 0;
 
-    do
+    while (*c1 && *c2)
     {
         // Compare single characters that don't match.
         if (*c1 != *c2)
@@ -64,7 +87,6 @@ static int strcmp_default(const char *s1, const char *s2)
         c1++;
         c2++;
     }
-    while (*c1 && *c2);
 
     if (*c1 == *c2) // The strings are of equal length.
         return temp_ret;
@@ -80,7 +102,7 @@ static int strcmp_natural(const char *s1, const char *s2)
 
     int temp_ret = 0;
 
-    do
+    while (*c1 && *c2)
     {
         // Compare two substrings of unlimited digit characters as two numbers.
         if (isdigit(*c1) && isdigit(*c2))
@@ -144,7 +166,6 @@ static int strcmp_natural(const char *s1, const char *s2)
         c1++;
         c2++;
     }
-    while (*c1 && *c2);
 
     if (*c1 == *c2) // The strings are of equal length.
         return temp_ret;
@@ -157,22 +178,27 @@ static int strcmp_natural(const char *s1, const char *s2)
 static int qsort_compar(const void *p1, const void *p2,
     int (*compar_fn)(const char *, const char *))
 {
-    // Separate path and basename parts.
+    // Separate path and basename parts. Paths without a separator, which
+    // callers may pass to file_list_merge(), have an empty path part.
     char *path1 = *(char **) p1;
     char *sep1 = strrchr(path1, DIR_SEPARATOR);
-    *sep1 = '\0';
     char *path2 = *(char **) p2;
     char *sep2 = strrchr(path2, DIR_SEPARATOR);
-    *sep2 = '\0';
+    if (sep1)
+        *sep1 = '\0';
+    if (sep2)
+        *sep2 = '\0';
 
     // Compare paths first...
-    int result = compar_fn(path1, path2);
-    *sep1 = DIR_SEPARATOR;
-    *sep2 = DIR_SEPARATOR;
+    int result = compar_fn(sep1 ? path1 : "", sep2 ? path2 : "");
+    if (sep1)
+        *sep1 = DIR_SEPARATOR;
+    if (sep2)
+        *sep2 = DIR_SEPARATOR;
 
     // ...and basenames only if necessary.
     if (result == 0)
-        result = compar_fn(sep1 + 1, sep2 + 1);
+        result = compar_fn(sep1 ? sep1 + 1 : path1, sep2 ? sep2 + 1 : path2);
 
     return result;
 }
@@ -215,555 +241,7212 @@ static int (*get_compar_fn(int sort_method))(const void *, const void *)
     }
 }
 
-// Stat stack ------------------------------------------------------------------
+// Directory reader ------------------------------------------------------------
+
+// On Linux, directories are read by calling getdents64 directly with a large
+// buffer, which needs far fewer system calls than readdir(). Other systems use
+// readdir(). Define FL_NO_GETDENTS to always use readdir().
+#if defined(__linux__) && defined(SYS_getdents64) && !defined(FL_NO_GETDENTS)
+#define FL_GETDENTS
+#endif
+
+// The size of a directory reader's buffer. Can be changed arbitrarily, but must
+// be large enough to hold a single directory entry.
+#define FL_DIR_BUFFER_SIZE 131072
+
+#ifdef FL_GETDENTS
+// A directory entry record as returned by getdents64.
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+// A directory entry, as returned by dir_reader_next(). The name is only valid
+// until the next call.
+struct dir_entry
+{
+    const char *name;
+    ino_t ino;
+    unsigned char type; // DT_ value, DT_UNKNOWN (0) if not available.
+};
 
-#define STAT_STACK_INITIAL_SIZE 512
+struct dir_reader
+{
+    int fd;
+    bool keep_fd;        // Don't close the file descriptor when done.
+    size_t n_reads;      // The number of read calls so far.
+#ifdef FL_GETDENTS
+    char *buf;
+    size_t pos;          // Offset of the next record in the buffer.
+    size_t len;          // Number of valid bytes in the buffer.
+#else
+    DIR *dir;
+#endif
+};
 
-struct stat_stack
+// A stack of unused buffers of equal size, e.g. directory reader buffers.
+// Buffers are returned to the pool and reused, instead of allocating a new
+// buffer for every directory.
+struct buffer_pool
 {
-    ssize_t top;         // Keeps track of the topmost array element.
+    size_t block_size;   // The size of each buffer.
+    size_t n;            // Number of buffers in the pool.
     size_t size;         // The array's maximum size.
-    struct stat **array;
+    char **buffers;
 };
 
-// Creates a new struct stat_stack.
-// Returns -1 on error, otherwise 0.
-static int stat_stack_create(struct stat_stack *stack)
+// Frees all buffers in a buffer pool.
+static void buffer_pool_destroy(struct buffer_pool *pool)
 {
-    stack->array = malloc(STAT_STACK_INITIAL_SIZE * sizeof(struct stat *));
-    if (stack->array == NULL)
-        return -1;
+    for (size_t i = 0; i < pool->n; i++)
+        free(pool->buffers[i]);
+    free(pool->buffers);
+    pool->buffers = NULL;
+    pool->n = pool->size = 0;
+}
 
-    stack->top = -1;
-    stack->size = STAT_STACK_INITIAL_SIZE;
+#ifdef FL_GETDENTS
+// Takes a buffer from a pool, or allocates a new one if the pool is empty.
+static char *buffer_pool_get(struct buffer_pool *pool)
+{
+    if (pool->n)
+        return pool->buffers[--pool->n];
 
-    return 0;
+    return malloc(pool->block_size);
 }
 
-// Adds a new stat buffer to the stack.
-// The values are supposed to point to existing variables.
-static int stat_stack_push(struct stat_stack *stack, struct stat *sb)
+// Returns a buffer to a pool. If the pool can't grow, the buffer is freed.
+static void buffer_pool_put(struct buffer_pool *pool, char *buf)
 {
-    if ((size_t) (stack->top + 1) == stack->size)
+    if (pool->n == pool->size)
     {
-        size_t new_size = stack->size * 2;
-        void *p = realloc(stack->array, new_size * sizeof(struct stat *));
+        size_t new_size = pool->size ? pool->size * 2 : 16;
+        char **p = realloc(pool->buffers, new_size * sizeof(char *));
         if (p == NULL)
-            return -1;
-        stack->array = p;
-        stack->size = new_size;
+        {
+            free(buf);
+            return;
+        }
+        pool->buffers = p;
+        pool->size = new_size;
+    }
+
+    pool->buffers[pool->n++] = buf;
+}
+#endif
+
+// Prepares reading the directory referred to by the open file descriptor <fd>.
+// On success, the reader owns the file descriptor, unless <keep_fd> is true. On
+// error, -1 is returned, errno is set, and the file descriptor is left open.
+static int dir_reader_open(struct dir_reader *reader, int fd, bool keep_fd,
+    struct buffer_pool *pool)
+{
+#ifdef FL_GETDENTS
+    reader->buf = buffer_pool_get(pool);
+    if (reader->buf == NULL)
+        return -1;
+    reader->pos = 0;
+    reader->len = 0;
+#else
+    (void) pool;
+
+    // A directory stream always owns its file descriptor.
+    int stream_fd = keep_fd ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : fd;
+    if (stream_fd == -1)
+        return -1;
+    reader->dir = fdopendir(stream_fd);
+    if (reader->dir == NULL)
+    {
+        if (keep_fd)
+            close(stream_fd);
+        return -1;
     }
+#endif
+    reader->fd = fd;
+    reader->keep_fd = keep_fd;
+    reader->n_reads = 0;
 
-    stack->array[++stack->top] = sb;
     return 0;
 }
 
-// Removes a stat entry from the stack.
-static void stat_stack_pop(struct stat_stack *stack)
+// Reads the next directory entry.
+// Returns 1 if an entry has been read, 0 at the end of the directory, and -1 on
+// error, with errno set.
+static int dir_reader_next(struct dir_reader *reader, struct dir_entry *entry)
 {
-    stack->top--;
+#ifdef FL_GETDENTS
+    if (reader->pos == reader->len)
+    {
+        long ret = syscall(SYS_getdents64, reader->fd, reader->buf,
+            FL_DIR_BUFFER_SIZE);
+        reader->n_reads++;
+        if (ret <= 0)
+            return ret == 0 ? 0 : -1;
+        reader->pos = 0;
+        reader->len = ret;
+    }
+
+    struct linux_dirent64 *d =
+        (struct linux_dirent64 *) (reader->buf + reader->pos);
+    reader->pos += d->d_reclen;
+    entry->name = d->d_name;
+    entry->ino = d->d_ino;
+    entry->type = d->d_type;
+#else
+    errno = 0;
+    struct dirent *dp = readdir(reader->dir);
+    reader->n_reads++;
+    if (dp == NULL)
+        return errno ? -1 : 0;
+    entry->name = dp->d_name;
+    entry->ino = dp->d_ino;
+#ifdef FL_NO_D_TYPE
+    entry->type = 0;
+#else
+    entry->type = dp->d_type;
+#endif
+#endif
+
+    return 1;
 }
 
-// Deallocates a stat stack's memory-allocated parts.
-static void stat_stack_destroy(struct stat_stack *stack)
+// Closes a directory reader and its file descriptor (unless it is kept).
+static void dir_reader_close(struct dir_reader *reader,
+    struct buffer_pool *pool)
 {
-    free(stack->array);
+#ifdef FL_GETDENTS
+    buffer_pool_put(pool, reader->buf);
+    if (!reader->keep_fd)
+        close(reader->fd);
+#else
+    (void) pool;
+    closedir(reader->dir);
+#endif
 }
 
-// Checks if a stat stack contains a specific inode and device combination.
-static int is_directory_loop(struct stat_stack *stack, struct stat *sb)
+// Returns 1 if a file name is "." or "..", otherwise 0.
+static inline int is_dot_or_dotdot(const char *name)
 {
-    for (size_t i = 0; i <= (size_t) stack->top; i++)
-    {
-        if (stack->array[i]->st_ino == sb->st_ino
-            && stack->array[i]->st_dev == sb->st_dev)
-        {
-            return 1;
-        }
-    }
+    return name[0] == '.'
+        && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
 
-    return 0;
+// Returns 1 if a directory entry's type information is not sufficient and the
+// file has to be stat'ed, otherwise 0.
+static inline int needs_stat(const struct dir_entry *dp, int flags)
+{
+#ifdef FL_NO_D_TYPE
+    (void) dp;
+    (void) flags;
+    return 1;
+#else
+    // Use stat even if the directory entry's .d_type is available, for:
+    // - FL_STAT: to provide all entries' stat information.
+    // - DT_DIR: to get device information for FL_XDEV, and for loop checks
+    //   before a directory is added during breadth-first traversal. (Otherwise,
+    //   loop checks are done with a single fstat() after opening it.)
+    // - DT_UNKNOWN: to get the type (for some FS it's always DT_UNKNOWN).
+    // - DT_LNK: to get the linked file's type.
+    // Matching files are stat'ed later if their number of hard links is needed
+    // for FL_UNIQUE_INODES.
+    return (flags & FL_STAT)
+        || (dp->type == DT_DIR && (flags & (FL_XDEV | FL_BREADTH_FIRST)))
+        || dp->type == DT_UNKNOWN
+        || (dp->type == DT_LNK && (flags & FL_FOLLOW_LINKS));
+#endif
 }
 
-// -----------------------------------------------------------------------------
+// File status -----------------------------------------------------------------
 
-// Creates a new string by concatenating dir and file (which must not be NULL),
-// inserting a directory separator character if necessary.
-static char *create_path(const char *dir, const char *file)
+// On Linux, statx() is used to request only a file's type, inode number and
+// device (unless FL_STAT is set), so that network and FUSE file systems don't
+// have to retrieve (or revalidate) attributes that are never used.
+#if defined(__linux__) && defined(STATX_TYPE)
+#define FL_STATX
+#define FL_STATX_MASK (STATX_TYPE | STATX_INO)
+
+// Returns the statx() flags that correspond to a traversal's flags.
+static inline int get_statx_flags(int flags)
 {
-    size_t dir_len = strlen(dir);
-    size_t file_len = strlen(file);
-    char *path;
+    return AT_NO_AUTOMOUNT
+        | (flags & FL_FOLLOW_LINKS ? 0 : AT_SYMLINK_NOFOLLOW)
+        | (flags & FL_STATX_DONT_SYNC ? AT_STATX_DONT_SYNC : 0);
+}
 
-    if (dir[dir_len - 1] == DIR_SEPARATOR)
+// Returns the statx() mask that corresponds to a traversal's flags.
+static inline unsigned get_statx_mask(int flags)
+{
+    if (flags & FL_STAT)
+        return STATX_BASIC_STATS;
+
+    return FL_STATX_MASK | (flags & FL_UNIQUE_INODES ? STATX_NLINK : 0);
+}
+
+// Returns the statx() mask that requests the metadata <fields> (see struct
+// fl_metadata) in addition to the file's type, inode number and device.
+static inline unsigned get_meta_statx_mask(int fields)
+{
+    return (fields & FL_META_SIZE ? STATX_SIZE : 0)
+        | (fields & FL_META_MTIME ? STATX_MTIME : 0)
+        | (fields & FL_META_MODE ? STATX_MODE : 0)
+        | (fields & FL_META_NLINK ? STATX_NLINK : 0);
+}
+
+// Copies the statx() fields used for traversal into a stat structure, or all
+// basic fields if FL_STAT is set.
+static void statx_to_stat(const struct statx *stx, struct stat *sb, int flags)
+{
+    sb->st_mode = stx->stx_mode;
+    sb->st_ino = stx->stx_ino;
+    sb->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    if (flags & (FL_STAT | FL_UNIQUE_INODES))
+        sb->st_nlink = stx->stx_nlink;
+    if (flags & FL_STAT)
     {
-        path = malloc(dir_len + file_len + 1);
-        if (path == NULL)
-            return NULL;
-        memcpy(path, dir, dir_len);
-        memcpy(path + dir_len, file, file_len + 1);
+        sb->st_uid = stx->stx_uid;
+        sb->st_gid = stx->stx_gid;
+        sb->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+        sb->st_size = stx->stx_size;
+        sb->st_blksize = stx->stx_blksize;
+        sb->st_blocks = stx->stx_blocks;
+        sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+        sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+        sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+        sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+        sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+        sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
     }
-    else
+}
+#endif
+
+// Retrieves the file type, inode number and device of the entry <name> of the
+// directory <dir_fd>, and its number of hard links if FL_UNIQUE_INODES is set.
+// Other members of <sb> may be left undefined, unless FL_STAT is set.
+// On error, -1 is returned and errno is set.
+static int stat_entry(int dir_fd, const char *name, int flags,
+    struct stat *sb)
+{
+#ifdef FL_STATX
+    struct statx stx;
+    if (statx(dir_fd, name, get_statx_flags(flags), get_statx_mask(flags),
+        &stx))
     {
-        path = malloc(dir_len + file_len + 2);
-        if (path == NULL)
-            return NULL;
-        memcpy(path, dir, dir_len);
-        path[dir_len] = DIR_SEPARATOR;
-        memcpy(path + dir_len + 1, file, file_len + 1);
+        return -1;
     }
-
-    return path;
+    statx_to_stat(&stx, sb, flags);
+    return 0;
+#else
+    return fstatat(dir_fd, name, sb,
+        flags & FL_FOLLOW_LINKS ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
 }
 
-// Removes all superflous and trailing directory separators from a directory
-// path, returning a dynamically allocated string.
-static char *create_clean_dir(const char *directory)
+// Retrieves the same stat information as stat_entry(), along with the metadata
+// <fields> (see struct fl_metadata).
+// On error, -1 is returned and errno is set.
+static int stat_entry_meta(int dir_fd, const char *name, int flags, int fields,
+    struct stat *sb)
 {
-    if (directory == NULL)
-        return NULL;
-
-    size_t len = strlen(directory);
-    if (len == 0)
-        return NULL;
+#ifdef FL_STATX
+    struct statx stx;
+    if (statx(dir_fd, name, get_statx_flags(flags),
+        get_statx_mask(flags) | get_meta_statx_mask(fields), &stx))
+    {
+        return -1;
+    }
+    statx_to_stat(&stx, sb, flags);
+    sb->st_nlink = stx.stx_nlink;
+    sb->st_size = stx.stx_size;
+    sb->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    sb->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    return 0;
+#else
+    (void) fields;
+    return stat_entry(dir_fd, name, flags, sb);
+#endif
+}
 
-    char *clean_dir = malloc(len + 1);
-    if (clean_dir == NULL)
-        return NULL;
+// Asynchronous stat -----------------------------------------------------------
 
-    // Build new string, omitting superflous directory separators.
-    size_t pos = 0;
-    int prev_char_is_separator = 0;
-    for (size_t i = 0; i < len; i++)
-    {
-        if (directory[i] == DIR_SEPARATOR)
-        {
-            if (prev_char_is_separator)
-                continue;
-            else
-                prev_char_is_separator = 1;
-        }
-        else
-            prev_char_is_separator = 0;
+// With flag FL_ASYNC_STAT, the entries of each directory reader buffer that need
+// to be stat'ed are submitted to an io_uring instance as one batch of statx
+// requests (Linux 5.6+). If io_uring is not available at run time, the
+// synchronous code path is used. Define FL_NO_IO_URING to disable it entirely.
+#if defined(FL_GETDENTS) && defined(FL_STATX) && !defined(FL_NO_IO_URING) \
+    && defined(__NR_io_uring_setup)
+#define FL_IO_URING
+#endif
 
-        clean_dir[pos++] = directory[i];
-    }
-    clean_dir[pos] = '\0';
+#ifdef FL_IO_URING
 
-    // Remove trailing directory separators.
-    while (clean_dir[--pos] == DIR_SEPARATOR && pos != 0)
-        clean_dir[pos] = '\0';
+// The maximum number of entries in a batch, which is also the size of the
+// submission queue. Can be changed arbitrarily.
+#define FL_STAT_BATCH_SIZE 128
 
-    return clean_dir;
-}
+// A minimal io_uring instance.
+struct ring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
 
-// Adds a path to an intermediate file list array.
-// size: the currently saved number of array elements
-// max_size: the array's currently allocated memory size
-// On error, 1 is returned and errno is set.
-static inline int file_list_add(char ***file_list, size_t *size,
-    size_t *max_size, char *path)
+// A batch of directory entries and, for each entry, the results of statx().
+struct stat_batch
 {
-    // Resize file list if needed.
-    if (*size == *max_size)
-    {
-        // Abort if the list has already reached the maximum allowed size.
-        if (*size == FL_MAX_LIST_SIZE)
-        {
-            errno = E2BIG;
-            return -1;
-        }
+    struct dir_entry entries[FL_STAT_BATCH_SIZE];
+    struct statx stx[FL_STAT_BATCH_SIZE];
+    int status[FL_STAT_BATCH_SIZE]; // -1: not stat'ed, 0: success, else errno
+};
 
-        size_t new_size = *max_size * 2;
+// Unmaps and closes an io_uring instance.
+static void ring_destroy(struct ring *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
 
-        // Overflow check.
-        if (new_size < *size)
-            new_size = SIZE_MAX;
+// Sets up an io_uring instance with <entries> submission queue entries.
+// On error, -1 is returned and errno is set.
+static int ring_create(struct ring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1)
+        return -1;
 
-        if (new_size > FL_MAX_LIST_SIZE)
-            *max_size = FL_MAX_LIST_SIZE;
-        else
-            *max_size = new_size;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
 
-        DEBUG_PRINTF("Resizing file list array: max. %zu elements\n",
-            *max_size);
-        char **p = realloc(*file_list, *max_size * sizeof(char *));
-        if (p == NULL)
-            return -1;
-        *file_list = p;
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ptr = ring->sq_ptr;
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED
+        || ring->sqes == MAP_FAILED)
+    {
+        int saved_errno = errno;
+        ring_destroy(ring);
+        ring->fd = -1;
+        errno = saved_errno;
+        return -1;
     }
 
-    // Add file name to file list.
-    (*file_list)[(*size)++] = path;
+    char *sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    char *cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
 
     return 0;
 }
 
-// Returns 1 if a file name matches a compiled regular expression, otherwise 0.
-static int matches_regex(const char *file_name, const regex_t *regex)
+// Reads the next batch of up to <max> directory entries. The batch ends early
+// instead of refilling the reader's buffer, so that all entry names stay valid
+// until the next call.
+// Returns the number of entries, 0 at the end of the directory, or -1 on error,
+// with errno set.
+static ssize_t dir_reader_next_batch(struct dir_reader *reader,
+    struct dir_entry *entries, size_t max)
 {
-    int ret = regexec(regex, file_name, 0, NULL, 0);
-    if (ret == 0)
-        return 1;
-
-#ifdef FILE_LIST_DEBUG
-    if (ret != REG_NOMATCH)
+    size_t n = 0;
+    int ret;
+    do
     {
-        char buf[512];
-        regerror(ret, regex, buf, sizeof(buf));
-        DEBUG_PRINTF("regexec(): %d (%s): \"%s\"\n", ret, buf, file_name);
+        ret = dir_reader_next(reader, &entries[n]);
+        if (ret != 1)
+            break;
+        n++;
     }
-#endif
+    while (n < max && reader->pos < reader->len);
 
-    return 0;
+    return n ? (ssize_t) n : ret;
 }
 
-// Recursively traverses a directory to populate a file list.
-// On error, -1 is returned and errno is set.
-static int parse_file_tree(char ***file_list, size_t *n_file_list,
-    size_t *n_file_list_max, int *file_type_arr, regex_t *file_ext,
-    char *directory, int directory_depth, struct stat_stack *stack, int flags)
+// Stats all entries of a batch that need it with asynchronous statx requests,
+// and waits until all of them have completed. Entries whose requests could not
+// be completed are stat'ed synchronously. If the io_uring instance fails, the
+// requests that are already in flight are still waited for, since the kernel
+// writes their results into the batch.
+// Returns -1 if the io_uring instance has failed and must not be used anymore,
+// otherwise 0.
+static int stat_batch_run(struct ring *ring, int dir_fd,
+    struct stat_batch *batch, size_t n, int flags)
 {
-// Creates the current file's path string, if not already done.
-#define CREATE_CURRENT_PATH()                                  \
-    do                                                         \
-    {                                                          \
-        if (current_path == NULL)                              \
-        {                                                      \
-            current_path = create_path(directory, dp->d_name); \
-            if (current_path == NULL)                          \
-            {                                                  \
-                closedir(dir);                                 \
-                return -1;                                     \
-            }                                                  \
-        }                                                      \
-    }                                                          \
-    while (0)
+    int statx_flags = get_statx_flags(flags);
+    unsigned statx_mask = get_statx_mask(flags);
+    int ret = 0;
 
-    DIR *dir = opendir(directory);
-    if (dir == NULL)
+    // Queue a statx request for each entry that needs it. Until completion,
+    // their status is EINPROGRESS.
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+    unsigned submitted = 0;
+    for (size_t i = 0; i < n; i++)
     {
-        DEBUG_PRINTF("opendir(): errno %d (%s): \"%s\"\n", errno,
-            strerror(errno), directory);
-        if (errno != EACCES)
-            return -1;
-        else
-            return 0;
+        if (is_dot_or_dotdot(batch->entries[i].name)
+            || !needs_stat(&batch->entries[i], flags))
+        {
+            batch->status[i] = -1;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = &ring->sqes[tail & mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dir_fd;
+        sqe->addr = (uintptr_t) batch->entries[i].name;
+        sqe->len = statx_mask;
+        sqe->off = (uintptr_t) &batch->stx[i];
+        sqe->statx_flags = statx_flags;
+        sqe->user_data = i;
+        ring->sq_array[tail & mask] = tail & mask;
+        batch->status[i] = EINPROGRESS;
+        tail++;
+        submitted++;
     }
+    if (submitted == 0)
+        return 0;
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
 
-    struct dirent *dp;
-    while ((dp = readdir(dir)) != NULL)
+    // Submit all requests and collect the completions as they arrive.
+    unsigned to_submit = submitted;
+    unsigned completed = 0;
+    while (completed < submitted)
     {
-        // Ignore current and parent directory.
-        if (dp->d_name[0] == '.')
+        // Once io_uring_enter() has failed, completions are polled.
+        long n_submitted = ret ? 0 : syscall(__NR_io_uring_enter, ring->fd,
+            to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n_submitted == -1)
         {
-            if (dp->d_name[1] == '\0')
-                continue;
-            else if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
+            if (errno == EINTR)
                 continue;
+
+            DEBUG_PRINTF("io_uring_enter(): errno %d (%s)\n", errno,
+                strerror(errno));
+            ret = -1;
+
+            // Withdraw the requests that the kernel has not consumed. Those in
+            // flight still write into the batch, so they are waited for
+            // before the batch is used or released.
+            unsigned sq_head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            submitted -= tail - sq_head;
+            __atomic_store_n(ring->sq_tail, sq_head, __ATOMIC_RELEASE);
+            continue;
         }
+        to_submit -= n_submitted;
 
-        struct stat sb;
-        char *current_path = NULL;
-        unsigned char current_type;
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            batch->status[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if (ret && completed < submitted)
+            nanosleep(&(struct timespec) { 0, 100000 }, NULL);
+    }
 
-        // Get the file's type.
-#ifndef FL_NO_D_TYPE
-        // Use stat even if the directory entry's .d_type is available, for:
-        // - DT_DIR: to get device information for loop checking.
-        // - DT_UNKNOWN: to get the type (for some FS it's always DT_UNKNOWN).
-        // - DT_LNK: to get the linked file's type.
-        if (dp->d_type == DT_DIR || dp->d_type == DT_UNKNOWN
-            || (dp->d_type == DT_LNK && (flags & FL_FOLLOW_LINKS)))
-#endif
+    // Kernels without IORING_OP_STATX fail the requests with EINVAL.
+    for (size_t i = 0; i < n; i++)
+    {
+        if (batch->status[i] == EINVAL || batch->status[i] == EINPROGRESS)
         {
-            CREATE_CURRENT_PATH();
-            int ret;
-            if (flags & FL_FOLLOW_LINKS)
-                ret = stat(current_path, &sb);
-            else
-                ret = lstat(current_path, &sb);
-            if (ret == -1)
-            {
-                DEBUG_PRINTF("stat(): errno %d (%s): \"%s\"\n", errno,
-                    strerror(errno), current_path);
-                free(current_path);
-                continue;
-            }
-            current_type = sb.st_mode >> 12 & 017; // Convert to .d_type value.
+            batch->status[i] = statx(dir_fd, batch->entries[i].name,
+                statx_flags, statx_mask, &batch->stx[i]) ? errno : 0;
         }
-#ifndef FL_NO_D_TYPE
-        else
-            current_type = dp->d_type;
+    }
+
+    return ret;
+}
+
 #endif
 
-        // Traverse next directory.
-        if (directory_depth && current_type == 4) // 4: DT_DIR
-        {
-            // Ignore directory if following it would cause a loop. Don't add it
-            // to the file list.
-            if (is_directory_loop(stack, &sb))
-            {
-                DEBUG_PRINTF("Directory loop detected: \"%s\"\n", current_path);
-                free(current_path);
-                continue;
-            }
+// Ignore files ----------------------------------------------------------------
 
-            // Ignore directory if it leads to a different device.
-            if (flags & FL_XDEV && stack->array[0]->st_dev != sb.st_dev)
-            {
-                DEBUG_PRINTF("Ignoring other file system: \"%s\"\n",
-                    current_path);
+// The names of the ignore files that are read with FL_IGNORE_FILES, in order of
+// increasing precedence.
+static const char *const ignore_file_names[] = { ".gitignore", ".ignore" };
+
+// A pattern of an ignore file.
+struct ignore_rule
+{
+    const char *pattern;
+    bool negate;         // "!pattern": re-include matching files.
+    bool dir_only;       // "pattern/": match directories only.
+    bool anchored;       // Match the path relative to the ignore file's
+                         // directory instead of the file name.
+    bool any_depth;      // "**/pattern": anchored, but at any level.
+    bool literal;        // No wildcards, so strcmp() suffices.
+    int fnm_flags;
+};
+
+// The rules of a directory's ignore files, compiled once when the directory is
+// opened. Subdirectories without ignore files of their own share their parent's
+// list; otherwise, their list links to the parent's list, whose rules have
+// lower precedence.
+struct ignore_list
+{
+    const struct ignore_list *parent;
+    size_t base_len;     // The length of the prefix of entries' paths that
+                         // make up the directory's path.
+    bool needs_path;     // This list or an ancestor has anchored rules.
+    size_t n_rules;
+    struct ignore_rule *rules;
+    char *text;          // The ignore files' contents, holding the patterns.
+};
+
+// Frees an ignore list.
+static void ignore_list_free(struct ignore_list *list)
+{
+    if (list == NULL)
+        return;
+
+    free(list->rules);
+    free(list->text);
+    free(list);
+}
+
+// Appends the contents of the file <name> in the directory <dir_fd> to a
+// dynamically allocated string, followed by a newline character.
+// Returns 0 on success and 1 if the file does not exist. On other errors, -1 is
+// returned and errno is set.
+static int read_ignore_file(int dir_fd, const char *name, char **text,
+    size_t *len)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT || errno == EACCES || errno == ENOTDIR ? 1 : -1;
+
+    struct stat sb;
+    if (fstat(fd, &sb))
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    if (!S_ISREG(sb.st_mode))
+    {
+        close(fd);
+        return 1;
+    }
+
+    size_t size = *len + sb.st_size + 2;
+    char *p = realloc(*text, size);
+    if (p == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    *text = p;
+
+    ssize_t n;
+    while (*len < size - 2
+        && (n = read(fd, *text + *len, size - 2 - *len)) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+            return -1;
+        }
+        *len += n;
+    }
+    close(fd);
+
+    (*text)[(*len)++] = '\n';
+    (*text)[*len] = '\0';
+    return 0;
+}
+
+// Parses a line of an ignore file into a rule, modifying the line.
+// Returns 1 if the line contains a pattern, otherwise 0.
+static int parse_ignore_line(char *line, struct ignore_rule *rule)
+{
+    // Strip trailing white space, unless escaped.
+    size_t len = strlen(line);
+    while (len && (line[len - 1] == ' ' || line[len - 1] == '\r'
+        || line[len - 1] == '\t') && (len < 2 || line[len - 2] != '\\'))
+    {
+        line[--len] = '\0';
+    }
+
+    if (len == 0 || line[0] == '#')
+        return 0;
+
+    rule->negate = line[0] == '!';
+    if (rule->negate)
+    {
+        line++;
+        len--;
+    }
+
+    rule->dir_only = len && line[len - 1] == DIR_SEPARATOR;
+    if (rule->dir_only)
+        line[--len] = '\0';
+
+    rule->any_depth = strncmp(line, "**/", 3) == 0;
+    if (rule->any_depth)
+    {
+        line += 3;
+        len -= 3;
+    }
+    else if (line[0] == DIR_SEPARATOR)
+    {
+        line++;
+        len--;
+        rule->anchored = true;
+    }
+    if (len == 0)
+        return 0;
+
+    if (strchr(line, DIR_SEPARATOR))
+        rule->anchored = true;
+    else if (rule->any_depth)
+        rule->any_depth = false; // Same as an unanchored pattern.
+
+    rule->pattern = line;
+    rule->literal = strpbrk(line, "*?[\\") == NULL;
+    // "**" may span directories; without it, wildcards stay within one.
+    rule->fnm_flags = strstr(line, "**") ? 0 : FNM_PATHNAME;
+
+    return 1;
+}
+
+// Reads the ignore files of the directory <directory>, whose open file
+// descriptor is <dir_fd>, and compiles their rules into a new list that links
+// to <parent>. If the directory has no rules of its own, <list> is set to NULL.
+// On error, -1 is returned and errno is set.
+static int load_ignore_list(int dir_fd, const char *directory,
+    const struct ignore_list *parent, struct ignore_list **list)
+{
+    *list = NULL;
+
+    char *text = NULL;
+    size_t len = 0;
+    bool found = false;
+    for (size_t i = 0;
+        i < sizeof(ignore_file_names) / sizeof(ignore_file_names[0]); i++)
+    {
+        int ret = read_ignore_file(dir_fd, ignore_file_names[i], &text, &len);
+        if (ret == -1)
+        {
+            DEBUG_PRINTF("Reading ignore file failed: errno %d (%s): "
+                "\"%s%c%s\"\n", errno, strerror(errno), directory,
+                DIR_SEPARATOR, ignore_file_names[i]);
+            free(text);
+            return -1;
+        }
+        if (ret == 0)
+            found = true;
+    }
+    if (!found)
+        return 0;
+
+    // Each line holds at most one rule.
+    size_t n_lines = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\n')
+            n_lines++;
+    }
+
+    struct ignore_list *l = calloc(1, sizeof(*l));
+    if (l == NULL || (l->rules = malloc(n_lines * sizeof(*l->rules))) == NULL)
+    {
+        free(l);
+        free(text);
+        return -1;
+    }
+    l->parent = parent;
+    l->text = text;
+
+    char *line = text;
+    for (char *end; (end = strchr(line, '\n')) != NULL; line = end + 1)
+    {
+        *end = '\0';
+        struct ignore_rule *rule = &l->rules[l->n_rules];
+        memset(rule, 0, sizeof(*rule));
+        if (parse_ignore_line(line, rule))
+        {
+            l->n_rules++;
+            if (rule->anchored)
+                l->needs_path = true;
+        }
+    }
+    if (l->n_rules == 0)
+    {
+        ignore_list_free(l);
+        return 0;
+    }
+
+    size_t dir_len = strlen(directory);
+    l->base_len = dir_len + (directory[dir_len - 1] != DIR_SEPARATOR);
+    if (parent && parent->needs_path)
+        l->needs_path = true;
+    *list = l;
+
+    return 0;
+}
+
+// Returns 1 if a rule matches a string, otherwise 0.
+static int matches_ignore_rule(const struct ignore_rule *rule, const char *s)
+{
+    if (rule->literal)
+        return strcmp(rule->pattern, s) == 0;
+
+    return fnmatch(rule->pattern, s, rule->fnm_flags) == 0;
+}
+
+// Checks if an ignore list excludes a directory entry. <path> is the entry's
+// path; it may be NULL if no rule in the list's chain is anchored.
+// Returns 1 if the entry is ignored, otherwise 0.
+static int is_ignored(const struct ignore_list *list, const char *path,
+    const char *name, bool is_dir)
+{
+    // The last matching rule of the deepest ignore file decides.
+    for (; list; list = list->parent)
+    {
+        for (size_t i = list->n_rules; i-- > 0;)
+        {
+            const struct ignore_rule *rule = &list->rules[i];
+            if (rule->dir_only && !is_dir)
+                continue;
+
+            bool match;
+            if (!rule->anchored)
+                match = matches_ignore_rule(rule, name);
+            else
+            {
+                const char *rel = path + list->base_len;
+                match = matches_ignore_rule(rule, rel);
+                while (!match && rule->any_depth
+                    && (rel = strchr(rel, DIR_SEPARATOR)) != NULL)
+                {
+                    match = matches_ignore_rule(rule, ++rel);
+                }
+            }
+
+            if (match)
+                return !rule->negate;
+        }
+    }
+
+    return 0;
+}
+
+// Directory cache -------------------------------------------------------------
+
+// The initial number of slots of a cache's hash table. Must be a power of 2.
+#define FL_CACHE_INITIAL_SIZE 1024
+
+// An entry of a cached directory.
+struct cached_entry
+{
+    size_t name;         // The offset of the name in the directory's names.
+    ino_t ino;
+    unsigned char type;
+};
+
+// A directory's entries, as they were when the directory had the modification
+// and status change times <mtime> and <ctime>.
+struct cached_dir
+{
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned generation; // The last traversal that used the directory.
+    size_t n_entries;
+    size_t entries_size;
+    struct cached_entry *entries;
+    size_t names_len;
+    size_t names_size;
+    char *names;
+};
+
+// Directories of previous traversals, looked up by device and inode number.
+struct fl_cache
+{
+    struct cached_dir **slots; // A hash table with linear probing.
+    size_t size;               // The number of slots.
+    size_t n;                  // The number of used slots.
+    unsigned generation;       // The current traversal.
+    time_t start_time;         // When the current traversal started.
+};
+
+// Frees a cached directory.
+static void cached_dir_free(struct cached_dir *dir)
+{
+    if (dir == NULL)
+        return;
+
+    free(dir->entries);
+    free(dir->names);
+    free(dir);
+}
+
+// Returns a hash value of a file's device and inode number.
+static inline size_t hash_file_id(dev_t dev, ino_t ino)
+{
+    return (uint64_t) ino * 0x9E3779B97F4A7C15u ^ (uint64_t) dev;
+}
+
+// Returns the index of a directory's hash table slot, which is either empty or
+// holds the directory.
+static size_t cache_find_slot(const struct fl_cache *cache, dev_t dev,
+    ino_t ino)
+{
+    size_t mask = cache->size - 1;
+    size_t i = hash_file_id(dev, ino) & mask;
+    while (cache->slots[i]
+        && (cache->slots[i]->ino != ino || cache->slots[i]->dev != dev))
+    {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+// Returns 1 if two timestamps are equal, otherwise 0.
+static inline int timespec_equal(const struct timespec *a,
+    const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Returns a directory's cached entries if the directory, whose stat information
+// is <sb>, has not been modified since they were cached. Otherwise, NULL is
+// returned.
+static struct cached_dir *cache_lookup(struct fl_cache *cache,
+    const struct stat *sb)
+{
+    if (cache->size == 0)
+        return NULL;
+
+    struct cached_dir *dir =
+        cache->slots[cache_find_slot(cache, sb->st_dev, sb->st_ino)];
+    if (dir == NULL || !timespec_equal(&dir->mtime, &sb->st_mtim)
+        || !timespec_equal(&dir->ctime, &sb->st_ctim))
+    {
+        return NULL;
+    }
+    dir->generation = cache->generation;
+
+    return dir;
+}
+
+// Inserts a directory into a cache, replacing a previous version. On success,
+// the cache owns the directory.
+// On error, -1 is returned and errno is set.
+static int cache_insert(struct fl_cache *cache, struct cached_dir *dir)
+{
+    // Keep the load factor at or below 1/2.
+    if ((cache->n + 1) * 2 > cache->size)
+    {
+        size_t new_size = cache->size ? cache->size * 2 : FL_CACHE_INITIAL_SIZE;
+        struct cached_dir **slots = calloc(new_size, sizeof(*slots));
+        if (slots == NULL)
+            return -1;
+
+        struct fl_cache new_cache = *cache;
+        new_cache.slots = slots;
+        new_cache.size = new_size;
+        for (size_t i = 0; i < cache->size; i++)
+        {
+            struct cached_dir *d = cache->slots[i];
+            if (d)
+                slots[cache_find_slot(&new_cache, d->dev, d->ino)] = d;
+        }
+        free(cache->slots);
+        *cache = new_cache;
+    }
+
+    size_t i = cache_find_slot(cache, dir->dev, dir->ino);
+    if (cache->slots[i])
+        cached_dir_free(cache->slots[i]);
+    else
+        cache->n++;
+    cache->slots[i] = dir;
+
+    return 0;
+}
+
+// Removes the directories that have not been used by the current traversal.
+// On error, -1 is returned and errno is set.
+static int cache_prune(struct fl_cache *cache)
+{
+    if (cache->size == 0)
+        return 0;
+
+    struct cached_dir **slots = calloc(cache->size, sizeof(*slots));
+    if (slots == NULL)
+        return -1;
+
+    struct cached_dir **old_slots = cache->slots;
+    cache->slots = slots;
+    cache->n = 0;
+    for (size_t i = 0; i < cache->size; i++)
+    {
+        struct cached_dir *d = old_slots[i];
+        if (d == NULL)
+            continue;
+
+        if (d->generation == cache->generation)
+        {
+            cache->slots[cache_find_slot(cache, d->dev, d->ino)] = d;
+            cache->n++;
+        }
+        else
+            cached_dir_free(d);
+    }
+    free(old_slots);
+
+    return 0;
+}
+
+// Creates an empty cache entry for a directory whose stat information is <sb>,
+// to record its entries while it is being read. Returns NULL if the directory
+// has been modified too recently to detect later modifications reliably, since
+// timestamps may be coarse.
+static struct cached_dir *cached_dir_create(struct fl_cache *cache,
+    const struct stat *sb)
+{
+    if (sb->st_mtim.tv_sec >= cache->start_time
+        || sb->st_ctim.tv_sec >= cache->start_time)
+    {
+        return NULL;
+    }
+
+    struct cached_dir *dir = calloc(1, sizeof(*dir));
+    if (dir == NULL)
+        return NULL;
+    dir->dev = sb->st_dev;
+    dir->ino = sb->st_ino;
+    dir->mtime = sb->st_mtim;
+    dir->ctime = sb->st_ctim;
+    dir->generation = cache->generation;
+
+    return dir;
+}
+
+// Adds an entry to a cached directory.
+// On error, -1 is returned and errno is set.
+static int cached_dir_add(struct cached_dir *dir, const char *name,
+    unsigned char type, ino_t ino)
+{
+    if (dir->n_entries == dir->entries_size)
+    {
+        size_t new_size = dir->entries_size ? dir->entries_size * 2 : 16;
+        void *p = realloc(dir->entries, new_size * sizeof(*dir->entries));
+        if (p == NULL)
+            return -1;
+        dir->entries = p;
+        dir->entries_size = new_size;
+    }
+
+    size_t name_size = strlen(name) + 1;
+    if (dir->names_size - dir->names_len < name_size)
+    {
+        size_t new_size = dir->names_size ? dir->names_size : 256;
+        while (new_size - dir->names_len < name_size)
+            new_size *= 2;
+        char *p = realloc(dir->names, new_size);
+        if (p == NULL)
+            return -1;
+        dir->names = p;
+        dir->names_size = new_size;
+    }
+    memcpy(dir->names + dir->names_len, name, name_size);
+
+    struct cached_entry *e = &dir->entries[dir->n_entries++];
+    e->name = dir->names_len;
+    e->ino = ino;
+    e->type = type;
+    dir->names_len += name_size;
+
+    return 0;
+}
+
+// -----------------------------------------------------------------------------
+
+// Creates a new string by concatenating dir and file (which must not be NULL),
+// inserting a directory separator character if necessary.
+static char *create_path(const char *dir, const char *file)
+{
+    size_t dir_len = strlen(dir);
+    size_t file_len = strlen(file);
+    char *path;
+
+    if (dir[dir_len - 1] == DIR_SEPARATOR)
+    {
+        path = malloc(dir_len + file_len + 1);
+        if (path == NULL)
+            return NULL;
+        memcpy(path, dir, dir_len);
+        memcpy(path + dir_len, file, file_len + 1);
+    }
+    else
+    {
+        path = malloc(dir_len + file_len + 2);
+        if (path == NULL)
+            return NULL;
+        memcpy(path, dir, dir_len);
+        path[dir_len] = DIR_SEPARATOR;
+        memcpy(path + dir_len + 1, file, file_len + 1);
+    }
+
+    return path;
+}
+
+// Appends a directory separator to a dynamically allocated path string.
+// On error, -1 is returned, errno is set, and the string is left unchanged.
+static int append_dir_separator(char **path)
+{
+    size_t new_len = strlen(*path) + 1;
+    char *new_path = realloc(*path, new_len + 1);
+    if (new_path == NULL)
+        return -1;
+
+    new_path[new_len - 1] = DIR_SEPARATOR;
+    new_path[new_len] = '\0';
+    *path = new_path;
+
+    return 0;
+}
+
+// Removes all superflous and trailing directory separators from a directory
+// path, returning a dynamically allocated string.
+static char *create_clean_dir(const char *directory)
+{
+    if (directory == NULL)
+        return NULL;
+
+    size_t len = strlen(directory);
+    if (len == 0)
+        return NULL;
+
+    char *clean_dir = malloc(len + 1);
+    if (clean_dir == NULL)
+        return NULL;
+
+    // Build new string, omitting superflous directory separators.
+    size_t pos = 0;
+    int prev_char_is_separator = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (directory[i] == DIR_SEPARATOR)
+        {
+            if (prev_char_is_separator)
+                continue;
+            else
+                prev_char_is_separator = 1;
+        }
+        else
+            prev_char_is_separator = 0;
+
+        clean_dir[pos++] = directory[i];
+    }
+    clean_dir[pos] = '\0';
+
+    // Remove trailing directory separators.
+    while (clean_dir[--pos] == DIR_SEPARATOR && pos != 0)
+        clean_dir[pos] = '\0';
+
+    return clean_dir;
+}
+
+// Adds a path to an intermediate file list array.
+// size: the currently saved number of array elements
+// max_size: the array's currently allocated memory size
+// On error, 1 is returned and errno is set.
+static inline int file_list_add(char ***file_list, size_t *size,
+    size_t *max_size, char *path)
+{
+    // Resize file list if needed.
+    if (*size == *max_size)
+    {
+        // Abort if the list has already reached the maximum allowed size.
+        if (*size == FL_MAX_LIST_SIZE)
+        {
+            errno = E2BIG;
+            return -1;
+        }
+
+        size_t new_size = *max_size * 2;
+
+        // Overflow check.
+        if (new_size < *size)
+            new_size = SIZE_MAX;
+
+        if (new_size > FL_MAX_LIST_SIZE)
+            *max_size = FL_MAX_LIST_SIZE;
+        else
+            *max_size = new_size;
+
+        DEBUG_PRINTF("Resizing file list array: max. %zu elements\n",
+            *max_size);
+        char **p = realloc(*file_list, *max_size * sizeof(char *));
+        if (p == NULL)
+            return -1;
+        *file_list = p;
+    }
+
+    // Add file name to file list.
+    (*file_list)[(*size)++] = path;
+
+    return 0;
+}
+
+// Returns 1 if a file name matches a compiled regular expression, otherwise 0.
+static int matches_regex(const char *file_name, const regex_t *regex)
+{
+    int ret = regexec(regex, file_name, 0, NULL, 0);
+    if (ret == 0)
+        return 1;
+
+#ifdef FILE_LIST_DEBUG
+    if (ret != REG_NOMATCH)
+    {
+        char buf[512];
+        regerror(ret, regex, buf, sizeof(buf));
+        DEBUG_PRINTF("regexec(): %d (%s): \"%s\"\n", ret, buf, file_name);
+    }
+#endif
+
+    return 0;
+}
+
+// Dynamic arrays --------------------------------------------------------------
+
+// A dynamic array of paths.
+struct path_array
+{
+    char **paths;
+    size_t n;
+    size_t size;
+};
+
+// Makes room for at least one more element in a dynamic array that holds <n>
+// elements of <elem_size> bytes and has room for <*size> elements.
+// Returns the (possibly moved) array, or NULL on error, with errno set.
+static void *grow_array(void *array, size_t n, size_t *size, size_t elem_size)
+{
+    if (n < *size)
+        return array;
+
+    size_t new_size = *size ? *size * 2 : 16;
+    void *p = realloc(array, new_size * elem_size);
+    if (p)
+        *size = new_size;
+
+    return p;
+}
+
+// Adds a path to a path array.
+// On error, -1 is returned and errno is set.
+static int path_array_add(struct path_array *a, char *path)
+{
+    char **p = grow_array(a->paths, a->n, &a->size, sizeof(*a->paths));
+    if (p == NULL)
+        return -1;
+    a->paths = p;
+    a->paths[a->n++] = path;
+
+    return 0;
+}
+
+// Path arenas -----------------------------------------------------------------
+
+// The maximum size of the chunks that a file list's paths are allocated from.
+// Chunks start small and double in size up to this limit; longer paths get a
+// chunk of their own. Can be changed arbitrarily.
+#define FL_ARENA_CHUNK_SIZE (1024 * 1024)
+
+// A chunk of memory that paths are allocated from, one after another.
+struct arena_chunk
+{
+    struct arena_chunk *next;    // The chunk allocated before.
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// The paths of a file list. Instead of being freed one by one, they are freed
+// along with the arena's chunks. A file list keeps its arena in the header in
+// front of its array (see struct list_header).
+struct path_arena
+{
+    struct arena_chunk *chunks;  // The newest chunk first.
+};
+
+// Allocates <size> bytes from an arena.
+// Returns NULL on error, with errno set.
+static char *arena_alloc(struct path_arena *a, size_t size)
+{
+    struct arena_chunk *c = a->chunks;
+    if (c == NULL || c->size - c->used < size)
+    {
+        size_t chunk_size = c == NULL ? 4096 : c->size * 2;
+        if (chunk_size > FL_ARENA_CHUNK_SIZE)
+            chunk_size = FL_ARENA_CHUNK_SIZE;
+        if (chunk_size < size)
+            chunk_size = size;
+        c = malloc(sizeof(*c) + chunk_size);
+        if (c == NULL)
+            return NULL;
+        c->next = a->chunks;
+        c->size = chunk_size;
+        c->used = 0;
+        a->chunks = c;
+    }
+
+    char *p = c->data + c->used;
+    c->used += size;
+
+    return p;
+}
+
+// Copies a string into an arena.
+// Returns NULL on error, with errno set.
+static char *arena_strdup(struct path_arena *a, const char *s)
+{
+    size_t size = strlen(s) + 1;
+    char *copy = arena_alloc(a, size);
+    if (copy)
+        memcpy(copy, s, size);
+
+    return copy;
+}
+
+// Creates a path inside an arena, like create_path(). If <dir_sep> is true, a
+// trailing directory separator is appended.
+// Returns NULL on error, with errno set.
+static char *arena_create_path(struct path_arena *a, const char *dir,
+    const char *file, bool dir_sep)
+{
+    size_t dir_len = strlen(dir);
+    size_t file_len = strlen(file);
+    bool sep = dir[dir_len - 1] != DIR_SEPARATOR;
+    char *path = arena_alloc(a, dir_len + sep + file_len + dir_sep + 1);
+    if (path == NULL)
+        return NULL;
+
+    char *p = path;
+    memcpy(p, dir, dir_len);
+    p += dir_len;
+    if (sep)
+        *p++ = DIR_SEPARATOR;
+    memcpy(p, file, file_len);
+    p += file_len;
+    if (dir_sep)
+        *p++ = DIR_SEPARATOR;
+    *p = '\0';
+
+    return path;
+}
+
+// Moves the chunks of arena <src> to arena <dest>, whose newest chunk stays
+// the one that paths are allocated from.
+static void arena_adopt(struct path_arena *dest, struct path_arena *src)
+{
+    if (src->chunks == NULL)
+        return;
+
+    if (dest->chunks == NULL)
+        dest->chunks = src->chunks;
+    else
+    {
+        struct arena_chunk *last = src->chunks;
+        while (last->next)
+            last = last->next;
+        last->next = dest->chunks->next;
+        dest->chunks->next = src->chunks;
+    }
+    src->chunks = NULL;
+}
+
+// Frees an arena's chunks, along with all paths allocated from them.
+static void arena_free(struct path_arena *a)
+{
+    struct arena_chunk *c = a->chunks;
+    while (c)
+    {
+        struct arena_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+    a->chunks = NULL;
+}
+
+// Returns true if <p> points into one of an arena's chunks.
+static bool arena_contains(const struct path_arena *a, const char *p)
+{
+    for (const struct arena_chunk *c = a->chunks; c; c = c->next)
+    {
+        if ((uintptr_t) p >= (uintptr_t) c->data
+            && (uintptr_t) p < (uintptr_t) (c->data + c->used))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The address range of an arena chunk's paths.
+struct chunk_range
+{
+    uintptr_t start;
+    uintptr_t end;
+};
+
+// Callback function for qsort(); compares the start of two chunk ranges.
+static int compar_chunk_range(const void *p1, const void *p2)
+{
+    uintptr_t a = ((const struct chunk_range *) p1)->start;
+    uintptr_t b = ((const struct chunk_range *) p2)->start;
+
+    return a < b ? -1 : a > b;
+}
+
+// Frees the paths of a NULL-terminated file list that are not allocated in its
+// arena <a>, like those that the caller has put into the list. The arena's
+// chunks are searched by address, so that huge file lists with many chunks
+// are freed fast.
+static void free_foreign_paths(char **file_list, const struct path_arena *a)
+{
+    size_t n_chunks = 0;
+    for (const struct arena_chunk *c = a->chunks; c; c = c->next)
+        n_chunks++;
+    if (n_chunks == 0)
+    {
+        for (char **p = file_list; *p; p++)
+            free(*p);
+        return;
+    }
+
+    // Without memory for the sorted ranges, the chunks are searched one by one.
+    struct chunk_range *ranges = malloc(n_chunks * sizeof(*ranges));
+    if (ranges)
+    {
+        size_t i = 0;
+        for (const struct arena_chunk *c = a->chunks; c; c = c->next, i++)
+        {
+            ranges[i].start = (uintptr_t) c->data;
+            ranges[i].end = (uintptr_t) (c->data + c->used);
+        }
+        qsort(ranges, n_chunks, sizeof(*ranges), compar_chunk_range);
+    }
+
+    for (char **p = file_list; *p; p++)
+    {
+        bool own;
+        if (ranges)
+        {
+            // Find the last range that starts at or before the path.
+            uintptr_t addr = (uintptr_t) *p;
+            size_t lo = 0;
+            size_t hi = n_chunks;
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                if (ranges[mid].start <= addr)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            own = lo > 0 && addr < ranges[lo - 1].end;
+        }
+        else
+            own = arena_contains(a, *p);
+        if (!own)
+            free(*p);
+    }
+    free(ranges);
+}
+
+// The header of a file list, which is allocated right in front of the list's
+// first element. The list itself stays a plain NULL-terminated array, but its
+// arena belongs to its allocation, so that the arena moves and is freed along
+// with the array.
+struct list_header
+{
+    struct arena_chunk *chunks;  // The list's arena.
+};
+
+// Returns the header of a file list created by finish_file_list().
+static struct list_header *get_list_header(char *const *file_list)
+{
+    return (struct list_header *) (void *) file_list - 1;
+}
+
+// Makes a file list from an array of <n> paths allocated by malloc(), whose
+// paths are allocated in arena <a>: the array is given a header that holds the
+// arena, and a terminating NULL pointer. On success, the array must no longer
+// be used, and the list owns the arena.
+// On error, NULL is returned, errno is set, and the array remains unchanged.
+static char **finish_file_list(char **paths, size_t n, struct path_arena *a)
+{
+    if (n + 1 > (SIZE_MAX - sizeof(struct list_header)) / sizeof(char *))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct list_header *h = realloc(paths,
+        sizeof(*h) + (n + 1) * sizeof(char *));
+    if (h == NULL)
+        return NULL;
+
+    char **file_list = (char **) (void *) (h + 1);
+    memmove(file_list, h, n * sizeof(char *));
+    file_list[n] = NULL;
+    h->chunks = a->chunks;
+    a->chunks = NULL;
+
+    return file_list;
+}
+
+// Metadata capture ------------------------------------------------------------
+
+// The arrays of struct fl_metadata, along with their field flags and the
+// struct stat members they are taken from.
+#define FL_META_FIELDS(X)              \
+    X(FL_META_SIZE, size, st_size)     \
+    X(FL_META_MTIME, mtime, st_mtim)   \
+    X(FL_META_MODE, mode, st_mode)     \
+    X(FL_META_INO, ino, st_ino)        \
+    X(FL_META_DEV, dev, st_dev)        \
+    X(FL_META_NLINK, nlink, st_nlink)
+
+// Metadata that is captured during a traversal, in arrays that grow along with
+// the file list.
+struct meta_table
+{
+    struct fl_metadata m;
+    size_t size;                 // The arrays' number of elements.
+};
+
+// A file list entry that remembers its position while the file list is sorted.
+// The path comes first, so that the entries can be sorted with the callback
+// functions for qsort().
+struct sort_entry
+{
+    char *path;
+    size_t index;
+};
+
+// Makes a metadata table's arrays hold at least <n> elements.
+// On error, -1 is returned and errno is set.
+static int meta_reserve(struct meta_table *mt, size_t n)
+{
+    if (n <= mt->size)
+        return 0;
+
+    size_t new_size = mt->size ? mt->size * 2 : FL_INITIAL_LIST_SIZE;
+    if (new_size < n)
+        new_size = n;
+
+#define RESIZE_META(field, member, sb_member)                                 \
+    if (mt->m.fields & field)                                                 \
+    {                                                                         \
+        void *p = realloc(mt->m.member, new_size * sizeof(*mt->m.member));    \
+        if (p == NULL)                                                        \
+            return -1;                                                        \
+        mt->m.member = p;                                                     \
+    }
+
+    FL_META_FIELDS(RESIZE_META)
+#undef RESIZE_META
+
+    mt->size = new_size;
+
+    return 0;
+}
+
+// Stores a file's metadata at position <i> of a metadata table, which must be
+// large enough. <sb> may be NULL if the file's stat information is unknown.
+static void meta_set(struct meta_table *mt, size_t i, const struct stat *sb)
+{
+    static const struct stat unknown;
+    if (sb == NULL)
+        sb = &unknown;
+
+#define SET_META(field, member, sb_member) \
+    if (mt->m.fields & field)              \
+        mt->m.member[i] = sb->sb_member;
+
+    FL_META_FIELDS(SET_META)
+#undef SET_META
+}
+
+#ifndef FL_NO_THREADS
+// Copies the first <n> elements of metadata table <src> to position <i> of
+// metadata table <dest>, which must be large enough.
+static void meta_copy(struct meta_table *dest, size_t i,
+    const struct meta_table *src, size_t n)
+{
+    if (n == 0)
+        return;
+
+#define COPY_META(field, member, sb_member)                                   \
+    if (dest->m.fields & field)                                               \
+        memcpy(dest->m.member + i, src->m.member, n * sizeof(*src->m.member));
+
+    FL_META_FIELDS(COPY_META)
+#undef COPY_META
+}
+#endif
+
+// Replaces a metadata table's arrays with arrays of exactly <n> elements, in
+// the order of <order>'s original positions, or in the current order if
+// <order> is NULL.
+// On error, -1 is returned and errno is set.
+static int meta_gather(struct meta_table *mt, const struct sort_entry *order,
+    size_t n)
+{
+#define GATHER_META(field, member, sb_member)                                 \
+    if (mt->m.fields & field)                                                 \
+    {                                                                         \
+        size_t size = sizeof(*mt->m.member);                                  \
+        char *p = malloc(n ? n * size : 1);                                   \
+        if (p == NULL)                                                        \
+            return -1;                                                        \
+        for (size_t i = 0; i < n; i++)                                        \
+        {                                                                     \
+            memcpy(p + i * size,                                              \
+                (char *) mt->m.member + (order ? order[i].index : i) * size,  \
+                size);                                                        \
+        }                                                                     \
+        free(mt->m.member);                                                   \
+        mt->m.member = (void *) p;                                            \
+    }
+
+    FL_META_FIELDS(GATHER_META)
+#undef GATHER_META
+
+    mt->size = n;
+
+    return 0;
+}
+
+// Frees the arrays of a file list's metadata.
+static void meta_free(struct fl_metadata *m)
+{
+#define FREE_META(field, member, sb_member) \
+    free(m->member);                        \
+    m->member = NULL;
+
+    FL_META_FIELDS(FREE_META)
+#undef FREE_META
+}
+
+// Sorts a file list of <n> paths along with its metadata table, whose arrays
+// are trimmed to the file list's size. <compar_fn> may be NULL to not sort.
+// On error, -1 is returned and errno is set.
+static int sort_file_list_meta(char **file_list, size_t n,
+    int (*compar_fn)(const void *, const void *), struct meta_table *mt)
+{
+    if (compar_fn == NULL)
+        return meta_gather(mt, NULL, n);
+
+    struct sort_entry *entries = malloc(n ? n * sizeof(*entries) : 1);
+    if (entries == NULL)
+        return -1;
+    for (size_t i = 0; i < n; i++)
+    {
+        entries[i].path = file_list[i];
+        entries[i].index = i;
+    }
+    qsort(entries, n, sizeof(*entries), compar_fn);
+    for (size_t i = 0; i < n; i++)
+        file_list[i] = entries[i].path;
+
+    int ret = meta_gather(mt, entries, n);
+    free(entries);
+
+    return ret;
+}
+
+// Inode sets ------------------------------------------------------------------
+
+// The initial number of slots of an inode set's hash table. Must be a power
+// of 2.
+#define FL_INODE_SET_INITIAL_SIZE 1024
+
+// A file's device and inode number.
+struct file_id
+{
+    dev_t dev;
+    ino_t ino;
+    bool used;           // False for empty slots.
+};
+
+// A set of files, identified by their device and inode numbers, like the
+// directories a traversal has entered or the files with multiple hard links it
+// has found.
+struct inode_set
+{
+    struct file_id *slots; // A hash table with linear probing.
+    size_t size;           // The number of slots.
+    size_t n;              // The number of used slots.
+#ifndef FL_NO_THREADS
+    pthread_mutex_t lock;  // Shared by the threads of a parallel traversal.
+#endif
+};
+
+// Returns the index of a file's hash table slot, which is either empty or holds
+// the file.
+static size_t inode_set_find_slot(const struct inode_set *set, dev_t dev,
+    ino_t ino)
+{
+    size_t mask = set->size - 1;
+    size_t i = hash_file_id(dev, ino) & mask;
+    while (set->slots[i].used
+        && (set->slots[i].ino != ino || set->slots[i].dev != dev))
+    {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+// Adds a file's device and inode number to an inode set.
+// Returns 1 if the file has been added, or 0 if it is in the set already.
+// On error, -1 is returned and errno is set.
+static int inode_set_add(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    // Keep the load factor at or below 1/2.
+    if ((set->n + 1) * 2 > set->size)
+    {
+        size_t new_size = set->size ? set->size * 2 : FL_INODE_SET_INITIAL_SIZE;
+        struct file_id *slots = calloc(new_size, sizeof(*slots));
+        if (slots == NULL)
+            return -1;
+
+        struct file_id *old_slots = set->slots;
+        size_t old_size = set->size;
+        set->slots = slots;
+        set->size = new_size;
+        for (size_t i = 0; i < old_size; i++)
+        {
+            const struct file_id *id = &old_slots[i];
+            if (id->used)
+                slots[inode_set_find_slot(set, id->dev, id->ino)] = *id;
+        }
+        free(old_slots);
+    }
+
+    struct file_id *id = &set->slots[inode_set_find_slot(set, dev, ino)];
+    if (id->used)
+        return 0;
+    id->dev = dev;
+    id->ino = ino;
+    id->used = true;
+    set->n++;
+
+    return 1;
+}
+
+// Returns true if a file's device and inode number are in an inode set.
+static bool inode_set_contains(const struct inode_set *set, dev_t dev,
+    ino_t ino)
+{
+    return set->n && set->slots[inode_set_find_slot(set, dev, ino)].used;
+}
+
+// Removes a file's device and inode number from an inode set, if present.
+static void inode_set_remove(struct inode_set *set, dev_t dev, ino_t ino)
+{
+    if (set->n == 0)
+        return;
+
+    size_t i = inode_set_find_slot(set, dev, ino);
+    if (!set->slots[i].used)
+        return;
+    set->n--;
+
+    // Move later files of the same probe sequence into the gap, so that
+    // lookups do not stop at it.
+    size_t mask = set->size - 1;
+    size_t j = i;
+    while (true)
+    {
+        set->slots[i].used = false;
+        size_t home;
+        do
+        {
+            j = (j + 1) & mask;
+            if (!set->slots[j].used)
+                return;
+            home = hash_file_id(set->slots[j].dev, set->slots[j].ino) & mask;
+        }
+        while (i <= j ? i < home && home <= j : i < home || home <= j);
+        set->slots[i] = set->slots[j];
+        i = j;
+    }
+}
+
+// Scan budgets ----------------------------------------------------------------
+
+// The maximum number of directory entries that a traversal examines between
+// two checks of its budget's clock and entry count. Can be changed arbitrarily
+// (min. 1).
+#define FL_BUDGET_INTERVAL 64
+
+// How often, in milliseconds, a thread of a parallel traversal that waits for
+// entries to be given back checks the cancellation flag. Can be changed
+// arbitrarily (min. 1).
+#define FL_BUDGET_POLL_MS 10
+
+// Limits that end a traversal early (see struct fl_options). The threads of a
+// parallel traversal share a budget, taking entries from it in portions of at
+// most FL_BUDGET_INTERVAL, so that .max_entries is never exceeded. They give
+// back what they have not used after each directory, and threads that find
+// all entries handed out wait for that, so that .max_entries is reached
+// regardless of the number of threads.
+struct budget
+{
+    struct timespec deadline;    // On CLOCK_MONOTONIC.
+    bool has_deadline;
+    size_t max_entries;          // 0 means "no limit".
+    size_t n_entries;            // The entries that have been handed out.
+    const int *cancel;           // NULL if the traversal can't be canceled.
+    enum FL_STATUS status;       // FL_STATUS_COMPLETE until a limit is hit.
+#ifndef FL_NO_THREADS
+    pthread_mutex_t lock;        // Used during parallel traversal only.
+    pthread_cond_t given_back;   // Signaled when a thread gives entries back
+                                 // or a limit is hit; uses CLOCK_MONOTONIC.
+    int n_holders;               // The threads that may give entries back.
+#endif
+};
+
+// Adds <ms> milliseconds to <ts>.
+static void add_ms(struct timespec *ts, long ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += ms % 1000 * 1000000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+// Sets up a budget according to <options>, starting the clock.
+// Returns NULL if there are no limits, so that entries need not be counted.
+static struct budget *budget_init(struct budget *b,
+    const struct fl_options *options)
+{
+    if (options == NULL || (options->timeout <= 0
+        && options->max_entries == 0 && options->cancel == NULL))
+    {
+        return NULL;
+    }
+
+    b->has_deadline = false;
+    b->max_entries = options->max_entries;
+    b->n_entries = 0;
+    b->cancel = options->cancel;
+    b->status = FL_STATUS_COMPLETE;
+#ifndef FL_NO_THREADS
+    b->n_holders = 0;
+#endif
+    if (options->timeout > 0
+        && clock_gettime(CLOCK_MONOTONIC, &b->deadline) == 0)
+    {
+        add_ms(&b->deadline, options->timeout);
+        b->has_deadline = true;
+    }
+
+    return b;
+}
+
+// Returns true if a budget's cancellation flag has been set.
+static inline bool budget_canceled(const struct budget *b)
+{
+#ifdef __GNUC__
+    return b->cancel && __atomic_load_n(b->cancel, __ATOMIC_RELAXED);
+#else
+    return b->cancel && *(const volatile int *) b->cancel;
+#endif
+}
+
+// Returns true if a budget's deadline has passed.
+static bool budget_expired(const struct budget *b)
+{
+    struct timespec now;
+    return b->has_deadline && clock_gettime(CLOCK_MONOTONIC, &now) == 0
+        && (now.tv_sec > b->deadline.tv_sec
+        || (now.tv_sec == b->deadline.tv_sec
+        && now.tv_nsec >= b->deadline.tv_nsec));
+}
+
+// Checks a budget's limits and, if none has been hit, hands out at most
+// FL_BUDGET_INTERVAL more entries. Must not be called by multiple threads at
+// the same time.
+// Returns the number of entries, or 0 if the budget is exhausted or, during
+// parallel traversal, if all entries are handed out but some may still be
+// given back.
+static size_t budget_take(struct budget *b)
+{
+    if (b->status != FL_STATUS_COMPLETE)
+        return 0;
+
+    if (budget_canceled(b))
+        b->status = FL_STATUS_CANCELED;
+    else if (b->max_entries && b->n_entries == b->max_entries)
+    {
+#ifndef FL_NO_THREADS
+        // Waiting for entries to be given back ends with the deadline.
+        if (b->n_holders)
+        {
+            if (!budget_expired(b))
+                return 0;
+            b->status = FL_STATUS_TIMEOUT;
+        }
+        else
+#endif
+            b->status = FL_STATUS_MAX_ENTRIES;
+    }
+    else if (budget_expired(b))
+        b->status = FL_STATUS_TIMEOUT;
+    if (b->status != FL_STATUS_COMPLETE)
+        return 0;
+
+    size_t n = FL_BUDGET_INTERVAL;
+    if (b->max_entries && n > b->max_entries - b->n_entries)
+        n = b->max_entries - b->n_entries;
+    b->n_entries += n;
+
+    return n;
+}
+
+// Traversal statistics --------------------------------------------------------
+
+// The counters of struct fl_stats.
+#define FL_STATS_COUNTERS(X) \
+    X(entries)               \
+    X(dirs_opened)           \
+    X(dir_reads)             \
+    X(stat_calls)            \
+    X(stat_failures)         \
+    X(loops_skipped)         \
+    X(xdev_skipped)          \
+    X(regex_evals)           \
+    X(regex_matches)         \
+    X(list_reallocs)
+
+// Increments the counter <member> of a traversal's statistics, if requested.
+#define COUNT(t, member)          \
+    do                            \
+    {                             \
+        if ((t)->stats)           \
+            (t)->stats->member++; \
+    }                             \
+    while (0)
+
+#ifndef FL_NO_THREADS
+// Adds the counters of <src> to those of <dst>.
+static void stats_add(struct fl_stats *dst, const struct fl_stats *src)
+{
+#define ADD_COUNTER(member) dst->member += src->member;
+    FL_STATS_COUNTERS(ADD_COUNTER)
+#undef ADD_COUNTER
+}
+#endif
+
+// Returns the current time of the monotonic clock in seconds.
+static double monotonic_time(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        return 0;
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Directory watches -----------------------------------------------------------
+
+#if defined(__linux__) && !defined(FL_NO_INOTIFY)
+#define FL_INOTIFY
+#endif
+
+#ifdef FL_INOTIFY
+
+// The inotify events that make a watched directory be read again.
+#define FL_WATCH_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+    | IN_MOVED_TO | IN_ONLYDIR)
+
+// The size of the buffer that inotify events are read into. Can be changed
+// arbitrarily (min. sizeof(struct inotify_event) + NAME_MAX + 1).
+#define FL_WATCH_BUFFER_SIZE 65536
+
+// A directory whose entries are watched for changes. Watched directories form a
+// tree, like the directories they belong to.
+struct watched_dir
+{
+    int wd;                      // The inotify watch descriptor.
+    int depth;                   // The remaining recursion depth.
+    bool dirty;                  // Changed since the directory was last read.
+    bool removed;                // No longer watched; freed on compaction.
+    unsigned generation;         // The last rescan that found the directory.
+    dev_t dev;
+    ino_t ino;
+    char *path;
+    struct watched_dir *parent;  // NULL for the start directory.
+    struct watched_dir **children;
+    size_t n_children;
+    size_t children_size;
+};
+
+// A file list that is kept up to date by reading changed directories again.
+struct fl_watch
+{
+    int fd;                      // The inotify instance.
+    int base_fd;                 // The start directory is relative to it.
+    int file_type_arr[13];
+    regex_t regex;
+    bool has_regex;
+    regex_t exclude;
+    bool has_exclude;
+    int flags;
+    int (*compar_fn)(const void *, const void *);
+    size_t max_open;
+    dev_t root_dev;
+    char *start_dir;
+    struct watched_dir *root;    // NULL if the start directory is gone.
+    struct watched_dir **dirs;   // All watched directories, sorted by wd.
+    size_t n_dirs;
+    size_t dirs_size;
+    size_t n_removed;            // The number of removed directories in dirs.
+    int *dirty;                  // The wds of changed directories.
+    size_t n_dirty;
+    size_t dirty_size;
+    unsigned generation;         // The current rescan.
+    struct watched_dir **visited; // Directories read by the current rescan.
+    size_t n_visited;
+    size_t visited_size;
+    struct path_array kept;      // Unchanged directories found by the current
+                                 // rescan, as path prefixes ("dir/").
+    char **index;                // The file list, sorted by strcmp().
+    char **list;                 // The NULL-terminated file list in sort order.
+    size_t n;
+};
+
+// Sorts a path array.
+static void path_array_sort(struct path_array *a,
+    int (*compar_fn)(const void *, const void *))
+{
+    if (a->n)
+        qsort(a->paths, a->n, sizeof(char *), compar_fn);
+}
+
+// Finds the position of the watch descriptor <wd> in a watch's array of
+// directories, or the position where it would have to be inserted.
+// Returns true if a directory that has not been removed has been found.
+static bool find_watched_dir(const struct fl_watch *w, int wd, size_t *pos)
+{
+    size_t lo = 0;
+    size_t hi = w->n_dirs;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (w->dirs[mid]->wd < wd)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *pos = lo;
+
+    return lo < w->n_dirs && w->dirs[lo]->wd == wd && !w->dirs[lo]->removed;
+}
+
+// Removes a watched directory from its parent's children.
+static void unlink_watched_dir(struct watched_dir *d)
+{
+    struct watched_dir *parent = d->parent;
+    if (parent == NULL)
+        return;
+
+    for (size_t i = 0; i < parent->n_children; i++)
+    {
+        if (parent->children[i] == d)
+        {
+            parent->children[i] = parent->children[--parent->n_children];
+            break;
+        }
+    }
+    d->parent = NULL;
+}
+
+// Forgets a watched directory along with all of its descendants. If
+// <rm_watch> is true, their watches are removed as well. The directories stay
+// in the watch's array until compact_watched_dirs() is called, so that removing
+// large subtrees does not move the array's elements repeatedly.
+static void remove_watched_dir(struct fl_watch *w, struct watched_dir *d,
+    bool rm_watch)
+{
+    // Remove the descendants first, deepest first, without recursion.
+    struct watched_dir *top = d;
+    while (true)
+    {
+        while (d->n_children)
+            d = d->children[d->n_children - 1];
+
+        struct watched_dir *parent = d->parent;
+        unlink_watched_dir(d);
+        if (rm_watch)
+            inotify_rm_watch(w->fd, d->wd);
+        if (d == w->root)
+            w->root = NULL;
+        d->removed = true;
+        w->n_removed++;
+
+        if (d == top)
+            break;
+        d = parent;
+    }
+}
+
+// Frees a watched directory.
+static void free_watched_dir(struct watched_dir *d)
+{
+    free(d->path);
+    free(d->children);
+    free(d);
+}
+
+// Frees the directories that have been removed from a watch.
+static void compact_watched_dirs(struct fl_watch *w)
+{
+    if (w->n_removed == 0)
+        return;
+
+    size_t n = 0;
+    for (size_t i = 0; i < w->n_dirs; i++)
+    {
+        if (w->dirs[i]->removed)
+            free_watched_dir(w->dirs[i]);
+        else
+            w->dirs[n++] = w->dirs[i];
+    }
+    w->n_dirs = n;
+    w->n_removed = 0;
+}
+
+// Marks a watched directory as changed.
+// On error, -1 is returned and errno is set.
+static int mark_watched_dir(struct fl_watch *w, struct watched_dir *d)
+{
+    if (d->dirty)
+        return 0;
+
+    int *p = grow_array(w->dirty, w->n_dirty, &w->dirty_size,
+        sizeof(*w->dirty));
+    if (p == NULL)
+        return -1;
+    w->dirty = p;
+    w->dirty[w->n_dirty++] = d->wd;
+    d->dirty = true;
+
+    return 0;
+}
+
+// Marks all watched directories as changed, so that the next rescan reads the
+// whole directory tree again. Since rescans descend into changed directories,
+// only the start directory needs to be queued.
+// On error, -1 is returned and errno is set.
+static int mark_all_watched_dirs(struct fl_watch *w)
+{
+    for (size_t i = 0; i < w->n_dirs; i++)
+        w->dirs[i]->dirty = true;
+    w->n_dirty = 0;
+    if (w->root == NULL)
+        return 0;
+
+    w->root->dirty = false;
+    return mark_watched_dir(w, w->root);
+}
+
+// Watches a directory that has been opened during a traversal in watch mode,
+// whose open file descriptor is <fd>, and makes it a child of <parent>. For the
+// traversal's start directory, <parent> is NULL. <watched> receives the
+// watched directory.
+// Returns 1 if the directory has been watched already at the same path and
+// has not changed since, so that it does not need to be traversed again.
+// Otherwise, 0 is returned, or -1 on error, with errno set.
+static int watch_dir(struct fl_watch *w, int fd, const char *path,
+    const struct stat *sb, int depth, struct watched_dir *parent,
+    struct watched_dir **watched)
+{
+    // The watch is added via the descriptor, which works for any path length.
+    // Without /proc, the path is used if it is valid in the current directory.
+    char fd_path[32];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    int wd = inotify_add_watch(w->fd, fd_path, FL_WATCH_MASK);
+    if (wd == -1 && errno == ENOENT
+        && (w->base_fd == AT_FDCWD || path[0] == '/'))
+    {
+        wd = inotify_add_watch(w->fd, path, FL_WATCH_MASK | IN_ONLYDIR);
+    }
+    if (wd == -1)
+    {
+        DEBUG_PRINTF("inotify_add_watch(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), path);
+        return -1;
+    }
+
+    size_t pos;
+    struct watched_dir *d;
+    if (find_watched_dir(w, wd, &pos))
+    {
+        d = w->dirs[pos];
+        if (strcmp(d->path, path))
+        {
+            // The directory has been moved, so its subdirectories' paths have
+            // changed as well.
+            char *copy = strdup(path);
+            if (copy == NULL)
+                return -1;
+            free(d->path);
+            d->path = copy;
+            d->dirty = true;
+        }
+        else if (!d->dirty)
+        {
+            char *prefix = create_path(path, "");
+            if (prefix == NULL || path_array_add(&w->kept, prefix))
+            {
+                free(prefix);
+                return -1;
+            }
+        }
+    }
+    else
+    {
+        struct watched_dir **p = grow_array(w->dirs, w->n_dirs, &w->dirs_size,
+            sizeof(*w->dirs));
+        if (p == NULL)
+            return -1;
+        w->dirs = p;
+
+        d = calloc(1, sizeof(*d));
+        if (d == NULL)
+            return -1;
+        d->path = strdup(path);
+        if (d->path == NULL)
+        {
+            free(d);
+            return -1;
+        }
+        d->wd = wd;
+        memmove(w->dirs + pos + 1, w->dirs + pos,
+            (w->n_dirs - pos) * sizeof(*w->dirs));
+        w->dirs[pos] = d;
+        w->n_dirs++;
+        d->dirty = true;
+        if (parent == NULL)
+            w->root = d;
+    }
+
+    // Keep the tree of watched directories in sync with the directory tree.
+    if (parent && d->parent != parent)
+    {
+        struct watched_dir **p = grow_array(parent->children,
+            parent->n_children, &parent->children_size,
+            sizeof(*parent->children));
+        if (p == NULL)
+            return -1;
+        parent->children = p;
+        unlink_watched_dir(d);
+        parent->children[parent->n_children++] = d;
+        d->parent = parent;
+    }
+
+    d->generation = w->generation;
+    *watched = d;
+    if (!d->dirty)
+        return 1;
+
+    struct watched_dir **p = grow_array(w->visited, w->n_visited,
+        &w->visited_size, sizeof(*w->visited));
+    if (p == NULL)
+        return -1;
+    w->visited = p;
+    w->visited[w->n_visited++] = d;
+    d->dirty = false;
+    d->depth = depth;
+    d->dev = sb->st_dev;
+    d->ino = sb->st_ino;
+
+    return 0;
+}
+
+// Reads all pending events of a watch's inotify instance, marking the
+// directories they belong to as changed. Directories whose watches have been
+// removed by the system, because they have been deleted or their file system
+// has been unmounted, are forgotten.
+// On error, -1 is returned and errno is set.
+static int read_watch_events(struct fl_watch *w)
+{
+    union
+    {
+        struct inotify_event event; // For alignment.
+        char bytes[FL_WATCH_BUFFER_SIZE];
+    } buf;
+
+    while (true)
+    {
+        ssize_t len = read(w->fd, buf.bytes, sizeof(buf.bytes));
+        if (len == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN ? 0 : -1;
+        }
+
+        const struct inotify_event *event;
+        for (char *p = buf.bytes; p < buf.bytes + len;
+            p += sizeof(*event) + event->len)
+        {
+            event = (const struct inotify_event *) p;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                DEBUG_PRINTF("inotify event queue overflow\n");
+                if (mark_all_watched_dirs(w))
+                    return -1;
+                continue;
+            }
+
+            size_t pos;
+            if (!find_watched_dir(w, event->wd, &pos))
+                continue;
+            struct watched_dir *d = w->dirs[pos];
+            if (event->mask & IN_IGNORED)
+            {
+                if (d->parent && mark_watched_dir(w, d->parent))
+                    return -1;
+                remove_watched_dir(w, d, true);
+            }
+            else if (mark_watched_dir(w, d))
+                return -1;
+        }
+    }
+}
+
+#endif
+
+// A directory that is being read. With an io_uring instance, its entries are
+// read and stat'ed in batches.
+struct dir_cursor
+{
+    struct dir_reader reader;
+    struct cached_dir *record;   // Non-NULL while the entries are recorded for
+                                 // the cache.
+#ifdef FL_IO_URING
+    struct stat_batch *batch;    // NULL if stat calls are synchronous.
+    size_t n;                    // The number of entries in the batch.
+    size_t pos;                  // The index of the batch's next entry.
+#endif
+};
+
+// A directory entry that has been read into memory before its directory was
+// closed early.
+struct saved_entry
+{
+    size_t name;         // The offset of the name in the frame's name buffer.
+    ino_t ino;           // From the stat information, if available.
+    mode_t mode;         // Valid if has_sb is true.
+    dev_t dev;           // Valid if has_sb is true.
+    nlink_t nlink;       // Valid if has_sb is true.
+    unsigned char type;
+    bool has_sb;
+};
+
+// A directory on the explicit stack of serial traversal. While the directory
+// is open, its entries are read via the cursor. After it has been closed early,
+// they are taken from the saved entries instead, and the descriptor is only
+// reopened to descend into subdirectories.
+struct dir_frame
+{
+    char *path;
+    const char *name;    // The name relative to the parent; NULL for the root.
+    bool owns_path;      // False if the path is owned by the caller.
+    bool add_path;       // The path is added to the file list when popped.
+    bool reading;        // True while the cursor is open.
+    bool lost;           // True if the directory could not be reopened.
+    int fd;              // -1 if the directory is closed.
+    int depth;           // The remaining recursion depth.
+    dev_t dev;
+    ino_t ino;
+    struct stat sb;      // If metadata is captured and add_path is true, the
+                         // directory's stat information.
+    const struct ignore_list *ignore; // The rules for the directory's entries.
+    struct ignore_list *own_ignore;   // From the directory's own ignore files.
+#ifdef FL_INOTIFY
+    struct watched_dir *watched;      // In watch mode, the directory's watch.
+#endif
+    struct dir_cursor cursor;    // Valid while reading is true.
+    struct saved_entry *saved;
+    struct stat *saved_sb; // With FL_STAT, the saved entries' stat information.
+    size_t n_saved;
+    size_t pos;          // The index of the next saved entry.
+    char *names;         // The saved entries' names.
+};
+
+// A match that is yielded by an iterator instead of being added to a file list.
+struct match
+{
+    char *path;          // NULL if there is none.
+    unsigned char type;
+    bool has_sb;
+    bool pushed;         // A directory whose frame is on top of the stack.
+    bool matches;        // False for directories yielded only to be skippable.
+    struct stat sb;
+};
+
+// Traversal state shared by all directories that are traversed. During
+// parallel traversal, each thread has its own.
+struct traversal
+{
+    char ***file_list;
+    size_t *n_file_list;
+    size_t *n_file_list_max;
+    int *file_type_arr;
+    regex_t *file_ext;
+    regex_t *exclude;            // Matches names of directories to ignore.
+    const struct ignore_list *ignore; // The ignore rules for the entries of the
+                                      // directory that is being parsed.
+    struct fl_cache *cache;      // NULL if directories are not cached.
+    struct meta_table *meta;     // NULL if metadata is not captured.
+    struct inode_set *inodes;    // NULL if hard links are not deduplicated.
+    struct inode_set *visited;   // Entered directories with FL_UNIQUE_DIRS,
+                                 // otherwise NULL.
+#ifdef FL_INOTIFY
+    struct fl_watch *watch;      // Non-NULL in watch mode.
+#endif
+    dev_t root_dev;
+    struct buffer_pool buffers;
+#ifdef FL_IO_URING
+    struct ring *ring;           // NULL if stat calls are synchronous.
+    struct ring ring_storage;
+    struct buffer_pool batches;  // Unused struct stat_batch buffers.
+#endif
+    struct dir_frame *frames;    // The directory stack (serial traversal only).
+    struct inode_set ancestors;  // The directories on the stack.
+    size_t n_frames;
+    size_t frames_size;
+    size_t n_open;               // The number of frames with an open directory.
+    size_t max_open;             // The maximum value of n_open.
+    int base_fd;                 // The start directory is relative to it.
+    struct dir_queue *queue;     // Breadth-first traversal only.
+    struct dir_node *node;       // The directory that is being parsed (if
+                                 // traversal is parallel or breadth-first).
+#ifndef FL_NO_THREADS
+    struct worker *worker;       // NULL if traversal is serial.
+    struct prefetch *prefetch;   // NULL if directories are not prefetched.
+    bool holds_budget;           // n_budget has been taken from the shared
+                                 // budget and not been given back yet.
+#endif
+    size_t n_pushed;             // The number of frames pushed so far.
+    struct match *yield;         // Non-NULL during iteration: matches are
+                                 // stored here instead of in the file list.
+    bool yield_dirs;             // Also yield directories that don't match
+                                 // when descending into them.
+    size_t n_matches;
+    size_t max_matches;          // 0 means "no limit".
+    struct budget *budget;       // NULL if the traversal is not limited.
+    struct fl_stats *stats;      // NULL if no statistics are kept.
+    struct path_arena *arena;    // The file list's paths are allocated here,
+                                 // or one by one if NULL.
+    size_t n_budget;             // Entries left before the budget is checked.
+    bool done;                   // n_matches has reached max_matches, or the
+                                 // budget is exhausted.
+    int flags;
+};
+
+// Sets up a traversal's buffers and, if requested, its io_uring instance.
+static void traversal_setup(struct traversal *t)
+{
+    t->buffers.block_size = FL_DIR_BUFFER_SIZE;
+#ifdef FL_IO_URING
+    t->batches.block_size = sizeof(struct stat_batch);
+    t->ring = NULL;
+    t->ring_storage.fd = -1;
+    // With FL_INODE_ORDER, entries are stat'ed in inode order instead of in
+    // batches as they are read.
+    if (t->flags & FL_ASYNC_STAT && !(t->flags & FL_INODE_ORDER))
+    {
+        if (ring_create(&t->ring_storage, FL_STAT_BATCH_SIZE) == 0)
+            t->ring = &t->ring_storage;
+        else
+        {
+            DEBUG_PRINTF("io_uring_setup(): errno %d (%s)\n", errno,
+                strerror(errno));
+        }
+    }
+#endif
+}
+
+// Frees the resources allocated by traversal_setup(). Preserves errno.
+static void traversal_cleanup(struct traversal *t)
+{
+    int saved_errno = errno;
+#ifdef FL_IO_URING
+    if (t->ring_storage.fd != -1)
+        ring_destroy(&t->ring_storage);
+    buffer_pool_destroy(&t->batches);
+#endif
+    buffer_pool_destroy(&t->buffers);
+    errno = saved_errno;
+}
+
+// Adds a file to an inode set that may be shared by the threads of a parallel
+// traversal, like inode_set_add().
+static int add_shared_inode(struct traversal *t, struct inode_set *set,
+    const struct stat *sb)
+{
+#ifndef FL_NO_THREADS
+    if (t->worker)
+        pthread_mutex_lock(&set->lock);
+#else
+    (void) t;
+#endif
+    int ret = inode_set_add(set, sb->st_dev, sb->st_ino);
+#ifndef FL_NO_THREADS
+    if (t->worker)
+        pthread_mutex_unlock(&set->lock);
+#endif
+
+    return ret;
+}
+
+#ifndef FL_NO_THREADS
+// Gives the entries that a thread of a parallel traversal has not used back to
+// the shared budget, so that other threads can take them. Must be called with
+// the budget's lock held.
+static void budget_give_back(struct traversal *t)
+{
+    struct budget *b = t->budget;
+    if (!t->holds_budget)
+        return;
+
+    b->n_entries -= t->n_budget;
+    b->n_holders--;
+    t->n_budget = 0;
+    t->holds_budget = false;
+    pthread_cond_broadcast(&b->given_back);
+}
+
+// Takes entries from the shared budget for a thread of a parallel traversal,
+// like budget_take(), after giving back its unused ones. If all entries are
+// handed out, waits until other threads give some back or stop holding any, or
+// until the deadline passes or the traversal is canceled.
+// Returns the number of entries, or 0 if the budget is exhausted.
+static size_t budget_take_shared(struct traversal *t)
+{
+    struct budget *b = t->budget;
+    pthread_mutex_lock(&b->lock);
+    budget_give_back(t);
+    size_t n;
+    while ((n = budget_take(b)) == 0 && b->status == FL_STATUS_COMPLETE)
+    {
+        // The cancellation flag is polled, since setting it signals nothing.
+        struct timespec wake;
+        if (b->cancel && clock_gettime(CLOCK_MONOTONIC, &wake) == 0)
+        {
+            add_ms(&wake, FL_BUDGET_POLL_MS);
+            if (b->has_deadline && (b->deadline.tv_sec < wake.tv_sec
+                || (b->deadline.tv_sec == wake.tv_sec
+                && b->deadline.tv_nsec < wake.tv_nsec)))
+            {
+                wake = b->deadline;
+            }
+            pthread_cond_timedwait(&b->given_back, &b->lock, &wake);
+        }
+        else if (b->has_deadline)
+            pthread_cond_timedwait(&b->given_back, &b->lock, &b->deadline);
+        else
+            pthread_cond_wait(&b->given_back, &b->lock);
+    }
+    if (n)
+    {
+        b->n_holders++;
+        t->holds_budget = true;
+    }
+    else
+    {
+        // Other waiting threads are done as well.
+        pthread_cond_broadcast(&b->given_back);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return n;
+}
+#endif
+
+// Counts a directory entry against a traversal's budget, which must not be
+// NULL. Returns true if the budget is exhausted, in which case the traversal is
+// done and the entry must be skipped.
+static inline bool spend_budget(struct traversal *t)
+{
+    if (t->n_budget == 0 || budget_canceled(t->budget))
+    {
+#ifndef FL_NO_THREADS
+        if (t->worker)
+            t->n_budget = budget_take_shared(t);
+        else
+#endif
+            t->n_budget = budget_take(t->budget);
+        if (t->n_budget == 0)
+        {
+            t->done = true;
+            return true;
+        }
+    }
+    t->n_budget--;
+
+    return false;
+}
+
+// Returns why a traversal has ended.
+static enum FL_STATUS traversal_status(const struct traversal *t)
+{
+    if (t->budget && t->budget->status != FL_STATUS_COMPLETE)
+        return t->budget->status;
+
+    return t->done ? FL_STATUS_MAX_MATCHES : FL_STATUS_COMPLETE;
+}
+
+// Checks if a matching file is new, i.e. not another hard link of a file that
+// has been added before. <sb> may be NULL if the file has not been stat'ed.
+// Returns 1 if the file is new, otherwise 0. On error, -1 is returned and errno
+// is set.
+static int is_new_match(struct traversal *t, unsigned char type,
+    const struct stat *sb)
+{
+    // Files with multiple hard links are added only once. Most files have a
+    // single link, which needs no lookup.
+    if (t->inodes && type != 4 && sb && sb->st_nlink > 1) // 4: DT_DIR
+        return add_shared_inode(t, t->inodes, sb);
+
+    return 1;
+}
+
+// Adds a new matching file's path to a traversal's file list or, during
+// iteration, yields it. <sb> may be NULL if the file has not been stat'ed; if
+// metadata is captured, it must hold the metadata, otherwise it is 0. On
+// success, the path is owned by the file list or iterator. Once t->max_matches
+// files have been found, the traversal is done.
+// On error, -1 is returned and errno is set.
+static int store_match(struct traversal *t, char *path, unsigned char type,
+    const struct stat *sb)
+{
+    if (t->yield)
+    {
+        t->yield->path = path;
+        t->yield->type = type;
+        t->yield->has_sb = sb != NULL;
+        t->yield->pushed = false;
+        t->yield->matches = true;
+        if (sb)
+            t->yield->sb = *sb;
+    }
+    else if (t->meta)
+    {
+        size_t i = *t->n_file_list;
+        if (i == *t->n_file_list_max)
+            COUNT(t, list_reallocs);
+        if (meta_reserve(t->meta, i + 1)
+            || file_list_add(t->file_list, t->n_file_list, t->n_file_list_max,
+            path))
+        {
+            return -1;
+        }
+        meta_set(t->meta, i, sb);
+    }
+    else
+    {
+        if (*t->n_file_list == *t->n_file_list_max)
+            COUNT(t, list_reallocs);
+        if (file_list_add(t->file_list, t->n_file_list, t->n_file_list_max,
+            path))
+        {
+            return -1;
+        }
+    }
+
+    if (t->max_matches && ++t->n_matches >= t->max_matches)
+        t->done = true;
+
+    return 0;
+}
+
+// Adds a matching file's dynamically allocated path <*path> to a traversal's
+// file list or, during iteration, yields it, like store_match(). Files that are
+// not new are skipped, and their paths are freed. With an arena, the file list
+// gets a copy inside the arena instead, and on success, <*path> is freed and
+// replaced with the copy. On error, <*path> is left unchanged.
+// On error, -1 is returned and errno is set.
+static int add_match(struct traversal *t, char **path, unsigned char type,
+    const struct stat *sb)
+{
+    int ret = is_new_match(t, type, sb);
+    if (ret != 1)
+    {
+        if (ret == 0)
+        {
+            free(*path);
+            *path = NULL;
+        }
+        return ret;
+    }
+
+    if (t->arena == NULL)
+        return store_match(t, *path, type, sb);
+
+    char *copy = arena_strdup(t->arena, *path);
+    if (copy == NULL || store_match(t, copy, type, sb))
+        return -1;
+    free(*path);
+    *path = copy;
+
+    return 0;
+}
+
+// Stats the matching file <name> of the directory <dir_fd> for what is needed
+// to add it to the file list: its number of hard links with FL_UNIQUE_INODES,
+// and the metadata that the traversal captures, requesting only the selected
+// fields.
+// On error, -1 is returned and errno is set.
+static int stat_match(struct traversal *t, int dir_fd, const char *directory,
+    const char *name, struct stat *sb)
+{
+    (void) directory; // Only used for debug output.
+    COUNT(t, stat_calls);
+    if (stat_entry_meta(dir_fd, name, t->flags, t->meta ? t->meta->m.fields : 0,
+        sb) == -1)
+    {
+        DEBUG_PRINTF("stat_entry_meta(): errno %d (%s): \"%s%c%s\"\n", errno,
+            strerror(errno), directory, DIR_SEPARATOR, name);
+        COUNT(t, stat_failures);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Prepares reading the directory referred to by the open file descriptor <fd>,
+// with the same file descriptor ownership rules as dir_reader_open().
+// On error, -1 is returned and errno is set.
+static int dir_cursor_open(struct traversal *t, struct dir_cursor *c, int fd,
+    bool keep_fd)
+{
+    c->record = NULL;
+#ifdef FL_IO_URING
+    c->batch = NULL;
+    c->n = c->pos = 0;
+    if (t->ring)
+    {
+        c->batch = (struct stat_batch *) buffer_pool_get(&t->batches);
+        if (c->batch == NULL)
+            return -1;
+    }
+
+    if (dir_reader_open(&c->reader, fd, keep_fd, &t->buffers))
+    {
+        if (c->batch)
+            buffer_pool_put(&t->batches, (char *) c->batch);
+        return -1;
+    }
+
+    return 0;
+#else
+    return dir_reader_open(&c->reader, fd, keep_fd, &t->buffers);
+#endif
+}
+
+// Closes a directory cursor.
+static void dir_cursor_close(struct traversal *t, struct dir_cursor *c)
+{
+    if (t->stats)
+        t->stats->dir_reads += c->reader.n_reads;
+    dir_reader_close(&c->reader, &t->buffers);
+    cached_dir_free(c->record); // Incomplete.
+#ifdef FL_IO_URING
+    if (c->batch)
+        buffer_pool_put(&t->batches, (char *) c->batch);
+#endif
+}
+
+// Reads a cursor's next entry. <status> receives the entry's stat status, with
+// the same values as struct stat_batch's member .status.
+// Returns 1 if an entry has been read, 0 at the end of the directory, and -1 on
+// error, with errno set.
+static int dir_cursor_read(struct traversal *t, struct dir_cursor *c,
+    struct dir_entry *entry, int *status)
+{
+#ifdef FL_IO_URING
+    if (c->batch)
+    {
+        if (c->pos == c->n)
+        {
+            ssize_t n = dir_reader_next_batch(&c->reader, c->batch->entries,
+                FL_STAT_BATCH_SIZE);
+            if (n <= 0)
+                return n;
+            c->n = n;
+            c->pos = 0;
+
+            if (t->ring == NULL)
+            {
+                for (size_t i = 0; i < c->n; i++)
+                    c->batch->status[i] = -1;
+            }
+            else if (stat_batch_run(t->ring, c->reader.fd, c->batch, c->n,
+                t->flags))
+            {
+                t->ring = NULL; // Continue synchronously.
+            }
+        }
+
+        *entry = c->batch->entries[c->pos];
+        *status = c->batch->status[c->pos];
+        c->pos++;
+        return 1;
+    }
+#else
+    (void) t;
+#endif
+
+    *status = -1;
+    return dir_reader_next(&c->reader, entry);
+}
+
+// Gets a cursor's next entry, skipping "." and ".." as well as entries that
+// could not be stat'ed. If the entry has already been stat'ed, <known_sb> is set
+// to <sb>, which receives the stat information, otherwise to NULL.
+// Returns 1 if an entry has been read and 0 at the end of the directory. Read
+// errors end the directory early.
+static int dir_cursor_next(struct traversal *t, struct dir_cursor *c,
+    const char *directory, struct dir_entry *entry, struct stat *sb,
+    struct stat **known_sb)
+{
+    (void) directory; // Only used for debug output.
+
+    int ret, status;
+    while ((ret = dir_cursor_read(t, c, entry, &status)) == 1)
+    {
+        // Ignore current and parent directory.
+        if (is_dot_or_dotdot(entry->name))
+            continue;
+
+        if (c->record
+            && cached_dir_add(c->record, entry->name, entry->type, entry->ino))
+        {
+            cached_dir_free(c->record);
+            c->record = NULL;
+        }
+
+        *known_sb = NULL;
+#ifdef FL_IO_URING
+        if (status >= 0)
+            COUNT(t, stat_calls);
+        if (status > 0)
+        {
+            DEBUG_PRINTF("statx(): errno %d (%s): \"%s%c%s\"\n", status,
+                strerror(status), directory, DIR_SEPARATOR, entry->name);
+            COUNT(t, stat_failures);
+            continue;
+        }
+        else if (status == 0)
+        {
+            statx_to_stat(&c->batch->stx[c->pos - 1], sb, t->flags);
+            *known_sb = sb;
+        }
+#else
+        (void) sb;
+#endif
+
+        return 1;
+    }
+
+    if (ret == -1)
+    {
+        DEBUG_PRINTF("dir_reader_next(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), directory);
+        cached_dir_free(c->record); // Incomplete.
+    }
+    else if (c->record && cache_insert(t->cache, c->record))
+        cached_dir_free(c->record);
+    c->record = NULL;
+
+    return 0;
+}
+
+static int push_dir_frame(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path);
+static int queue_dir_node(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path);
+static int is_node_loop(const struct dir_node *node, const struct stat *sb);
+static int reopen_dir_frame(struct traversal *t, size_t index);
+#ifndef FL_NO_THREADS
+static int push_dir_node(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path);
+static void prefetch_start(struct traversal *t,
+    const struct fl_options *options);
+static void prefetch_follow(struct prefetch *pf, dev_t dev, ino_t ino);
+static void prefetch_skip(struct prefetch *pf, dev_t dev, ino_t ino);
+static void prefetch_stop(struct traversal *t);
+#endif
+
+// Returns 1 if a file name matches a compiled regular expression, otherwise 0,
+// counting the attempt in the traversal's statistics.
+static int traversal_matches_regex(struct traversal *t, const char *file_name,
+    const regex_t *regex)
+{
+    int ret = matches_regex(file_name, regex);
+    if (t->stats)
+    {
+        t->stats->regex_evals++;
+        t->stats->regex_matches += ret;
+    }
+
+    return ret;
+}
+
+// Checks if descending into a directory would cause a loop. During
+// breadth-first or parallel traversal, <parent> is the node of the directory's
+// parent, otherwise it is NULL. With FL_UNIQUE_DIRS, any directory that has
+// been entered before counts as a loop, and other directories are marked as
+// entered.
+// Returns 1 for a loop, otherwise 0. On error, -1 is returned and errno is set.
+static int is_traversal_loop(struct traversal *t,
+    const struct dir_node *parent, const struct stat *sb)
+{
+    if (t->visited)
+    {
+        int ret = add_shared_inode(t, t->visited, sb);
+        return ret == -1 ? -1 : !ret;
+    }
+
+    if (parent)
+        return is_node_loop(parent, sb);
+
+    return inode_set_contains(&t->ancestors, sb->st_dev, sb->st_ino);
+}
+
+// Processes a single entry of <directory>, whose open file descriptor is
+// <dir_fd>: schedules the entry's traversal if it is a directory, and adds it
+// to the file list if it matches. <known_sb> holds the entry's stat information
+// if it has already been retrieved, otherwise it is NULL. <dir_fd> is -1 if the
+// directory has been closed early, in which case all entries that need it have
+// been stat'ed already.
+// On error, -1 is returned and errno is set.
+static int parse_entry(struct traversal *t, int dir_fd, char *directory,
+    int directory_depth, const struct dir_entry *dp, struct stat *known_sb)
+{
+// Creates the current file's path string, if not already done.
+#define CREATE_CURRENT_PATH()                                  \
+    do                                                         \
+    {                                                          \
+        if (current_path == NULL)                              \
+        {                                                      \
+            current_path = create_path(directory, dp->name);   \
+            if (current_path == NULL)                          \
+                return -1;                                     \
+        }                                                      \
+    }                                                          \
+    while (0)
+
+    if (t->budget && spend_budget(t))
+        return 0;
+    COUNT(t, entries);
+
+    int flags = t->flags;
+    struct stat sb;
+    bool have_sb = true;
+    char *current_path = NULL;
+    unsigned char current_type;
+
+    // Get the file's type.
+    if (known_sb)
+    {
+        sb = *known_sb;
+        current_type = sb.st_mode >> 12 & 017; // Convert to .d_type value.
+    }
+    else if (needs_stat(dp, flags))
+    {
+        COUNT(t, stat_calls);
+        if (stat_entry(dir_fd, dp->name, flags, &sb) == -1)
+        {
+            DEBUG_PRINTF("stat_entry(): errno %d (%s): \"%s%c%s\"\n", errno,
+                strerror(errno), directory, DIR_SEPARATOR, dp->name);
+            COUNT(t, stat_failures);
+            return 0;
+        }
+        current_type = sb.st_mode >> 12 & 017;
+    }
+    else
+    {
+        current_type = dp->type;
+        have_sb = false;
+    }
+
+    // Ignore excluded directories without opening them.
+    if (current_type == 4 && t->exclude
+        && traversal_matches_regex(t, dp->name, t->exclude))
+    {
+        DEBUG_PRINTF("Excluding directory: \"%s%c%s\"\n", directory,
+            DIR_SEPARATOR, dp->name);
+        return 0;
+    }
+
+    // Apply the rules of ignore files.
+    if (t->ignore)
+    {
+        if (t->ignore->needs_path)
+            CREATE_CURRENT_PATH();
+        if (is_ignored(t->ignore, current_path, dp->name, current_type == 4))
+        {
+            free(current_path);
+#ifndef FL_NO_THREADS
+            if (current_type == 4 && t->prefetch)
+            {
+                prefetch_skip(t->prefetch, have_sb ? sb.st_dev
+                    : t->frames[t->n_frames - 1].dev,
+                    have_sb ? sb.st_ino : dp->ino);
+            }
+#endif
+            return 0;
+        }
+    }
+
+    // Traverse next directory.
+    bool descend = false;
+    if (directory_depth && current_type == 4) // 4: DT_DIR
+    {
+        // Ignore directory if following it would cause a loop. Don't add it
+        // to the file list. Without stat information, this is checked after
+        // opening the directory.
+        int loop = have_sb ? is_traversal_loop(t, t->node, &sb) : 0;
+        if (loop == -1)
+            return -1;
+        if (loop)
+        {
+            DEBUG_PRINTF("Directory loop detected: \"%s%c%s\"\n",
+                directory, DIR_SEPARATOR, dp->name);
+            COUNT(t, loops_skipped);
+            return 0;
+        }
+
+        // Ignore directory if it leads to a different device.
+        if (flags & FL_XDEV && t->root_dev != sb.st_dev)
+        {
+            DEBUG_PRINTF("Ignoring other file system: \"%s%c%s\"\n",
+                directory, DIR_SEPARATOR, dp->name);
+            COUNT(t, xdev_skipped);
+        }
+        else
+            descend = true;
+    }
+
+    bool matches = t->file_type_arr[current_type] == 1
+        && (t->file_ext == NULL
+        || traversal_matches_regex(t, dp->name, t->file_ext));
+
+    // Matches that are added to the file list right away are stat'ed only now
+    // if more than their type is needed: the number of hard links of files
+    // other than directories with FL_UNIQUE_INODES, and metadata, requesting
+    // only the selected fields. Other directories are fstat'ed after they have
+    // been opened anyway.
+    if (matches && (!descend || t->queue)
+        && ((t->inodes && current_type != 4 && !have_sb) // 4: DT_DIR
+        || (t->meta && !(flags & FL_STAT))))
+    {
+        // The directory may have been closed after it has been read.
+        if (dir_fd == -1)
+        {
+            int ret = reopen_dir_frame(t, t->n_frames - 1);
+            if (ret)
+            {
+                free(current_path);
+                return ret == 1 ? 0 : -1;
+            }
+            dir_fd = t->frames[t->n_frames - 1].fd;
+        }
+        if (stat_match(t, dir_fd, directory, dp->name, &sb) == 0)
+            have_sb = true;
+        // Without stat information, the file's metadata is 0, unless its
+        // hard links need to be checked.
+        else if (t->inodes && current_type != 4) // 4: DT_DIR
+        {
+            free(current_path);
+            return 0;
+        }
+        else
+            have_sb = false;
+    }
+
+    if (descend)
+    {
+        CREATE_CURRENT_PATH();
+        int child_depth = directory_depth > 0 ? directory_depth - 1
+            : directory_depth;
+
+        // During breadth-first traversal, the directory is queued, and added
+        // to the file list right away.
+        if (t->queue)
+        {
+            return queue_dir_node(t, current_path, dp->name, &sb, child_depth,
+                matches);
+        }
+
+#ifndef FL_NO_THREADS
+        // During parallel traversal, the directory becomes a new task, which
+        // adds the directory to the file list itself once it has passed the
+        // loop check.
+        if (t->node)
+        {
+            if (matches && flags & FL_DIR_SEP
+                && append_dir_separator(&current_path))
+            {
+                free(current_path);
+                return -1;
+            }
+
+            return push_dir_node(t, current_path, dp->name,
+                have_sb ? &sb : NULL, child_depth, matches);
+        }
+#endif
+
+        // Otherwise, it is pushed onto the directory stack and added to the
+        // file list after it has been traversed.
+        return push_dir_frame(t, current_path, dp->name, have_sb ? &sb : NULL,
+            child_depth, matches);
+    }
+
+    // Add file name to file list. With an arena, the path is created right
+    // inside it, unless it exists already.
+    if (matches && t->arena && current_path == NULL)
+    {
+        const struct stat *match_sb = have_sb ? &sb : NULL;
+        int ret = is_new_match(t, current_type, match_sb);
+        if (ret != 1)
+            return ret;
+        current_path = arena_create_path(t->arena, directory, dp->name,
+            current_type == 4 && flags & FL_DIR_SEP);
+        if (current_path == NULL)
+            return -1;
+        return store_match(t, current_path, current_type, match_sb);
+    }
+    if (matches)
+    {
+        CREATE_CURRENT_PATH();
+
+        // If requested, add a trailing directory separator.
+        if (current_type == 4 && flags & FL_DIR_SEP
+            && append_dir_separator(&current_path))
+        {
+            free(current_path);
+            return -1;
+        }
+
+        if (add_match(t, &current_path, current_type, have_sb ? &sb : NULL))
+        {
+            free(current_path);
+            return -1;
+        }
+    }
+    else if (current_path)
+        free(current_path);
+
+    return 0;
+
+#undef CREATE_CURRENT_PATH
+}
+
+// Directory nodes -------------------------------------------------------------
+
+// A directory that is traversed as a task of its own during parallel or
+// breadth-first traversal. A node stays alive as long as any of its descendants
+// does, so that subdirectories can be opened relative to their parent's file
+// descriptor and so that each task's ancestry is available for loop detection.
+struct dir_node
+{
+    struct dir_node *parent;
+    char *path;
+    bool owns_path;      // False if the path is owned by a file list.
+    bool add_path;       // The path is added to the file list when traversed.
+    bool has_id;         // False if dev and ino are not known before opening.
+    int fd;              // -1 while the directory is not open.
+    int depth;           // The remaining recursion depth.
+    unsigned refs;       // 1 until the node is traversed, plus 1 per child.
+    dev_t dev;
+    ino_t ino;
+    const struct ignore_list *ignore; // The rules for the directory's entries.
+    struct ignore_list *own_ignore;   // From the directory's own ignore files.
+    char name[];         // The directory's name, relative to its parent.
+};
+
+// Creates a node for the subdirectory <name> of the directory node <parent>,
+// without adding a reference to <parent>. The node owns the path string, even on
+// error. <sb> may be NULL if the directory has not been stat'ed.
+// Returns NULL on error, with errno set.
+static struct dir_node *dir_node_create(struct dir_node *parent, char *path,
+    const char *name, const struct stat *sb, int depth, bool add_path)
+{
+    size_t name_len = strlen(name);
+    struct dir_node *node = malloc(sizeof(*node) + name_len + 1);
+    if (node == NULL)
+    {
+        free(path);
+        return NULL;
+    }
+    node->parent = parent;
+    node->path = path;
+    node->owns_path = true;
+    node->add_path = add_path;
+    node->has_id = sb != NULL;
+    node->fd = -1;
+    node->depth = depth;
+    node->refs = 1;
+    if (sb)
+    {
+        node->dev = sb->st_dev;
+        node->ino = sb->st_ino;
+    }
+    node->ignore = parent->ignore;
+    node->own_ignore = NULL;
+    memcpy(node->name, name, name_len + 1);
+
+    return node;
+}
+
+// Drops a reference to a node. Nodes without references are freed, which in
+// turn drops their parents' references. During parallel traversal, the shared
+// lock must be held.
+static void dir_node_release(struct dir_node *node)
+{
+    while (node && --node->refs == 0)
+    {
+        struct dir_node *parent = node->parent;
+        if (node->fd != -1)
+            close(node->fd);
+        if (node->owns_path)
+            free(node->path);
+        ignore_list_free(node->own_ignore);
+        free(node);
+        node = parent;
+    }
+}
+
+// Reads an opened directory node's ignore files if requested, so that their
+// rules apply to the directory's entries.
+// On error, -1 is returned and errno is set.
+static int load_node_ignore_list(struct traversal *t, struct dir_node *node)
+{
+    if (!(t->flags & FL_IGNORE_FILES))
+        return 0;
+
+    if (load_ignore_list(node->fd, node->path, node->ignore, &node->own_ignore))
+        return -1;
+    if (node->own_ignore)
+        node->ignore = node->own_ignore;
+
+    return 0;
+}
+
+// Checks if a directory node or one of its ancestors has a specific inode and
+// device combination.
+static int is_node_loop(const struct dir_node *node, const struct stat *sb)
+{
+    for (; node; node = node->parent)
+    {
+        if (node->ino == sb->st_ino && node->dev == sb->st_dev)
+            return 1;
+    }
+
+    return 0;
+}
+
+// Serial traversal ------------------------------------------------------------
+
+// The initial size of the directory stack. Can be changed arbitrarily.
+#define FL_INITIAL_STACK_SIZE 64
+
+// The default maximum number of directories that serial traversal keeps open at
+// the same time. Can be changed arbitrarily (minimum 2).
+#define FL_MAX_OPEN_DIRS 64
+
+// Reads all remaining entries of a frame's directory into memory and closes
+// the frame's cursor. If <stat> is true, entries that need to be stat'ed are
+// stat'ed now.
+// On error, -1 is returned and errno is set.
+static int save_dir_frame_entries(struct traversal *t, struct dir_frame *f,
+    bool stat)
+{
+    size_t saved_size = 0;
+    size_t names_len = 0;
+    size_t names_size = 0;
+    struct dir_entry entry;
+    struct stat sb;
+    struct stat *known_sb;
+    while (dir_cursor_next(t, &f->cursor, f->path, &entry, &sb, &known_sb))
+    {
+        if (stat && known_sb == NULL && needs_stat(&entry, t->flags))
+        {
+            COUNT(t, stat_calls);
+            if (stat_entry(f->fd, entry.name, t->flags, &sb) == -1)
+            {
+                DEBUG_PRINTF("stat_entry(): errno %d (%s): \"%s%c%s\"\n",
+                    errno, strerror(errno), f->path, DIR_SEPARATOR,
+                    entry.name);
+                COUNT(t, stat_failures);
+                continue;
+            }
+            known_sb = &sb;
+        }
+
+        if (f->n_saved == saved_size)
+        {
+            size_t new_size = saved_size ? saved_size * 2 : 64;
+            void *p = realloc(f->saved, new_size * sizeof(*f->saved));
+            if (p == NULL)
+                return -1;
+            f->saved = p;
+            if (stat && t->flags & FL_STAT)
+            {
+                p = realloc(f->saved_sb, new_size * sizeof(*f->saved_sb));
+                if (p == NULL)
+                    return -1;
+                f->saved_sb = p;
+            }
+            saved_size = new_size;
+        }
+
+        size_t name_size = strlen(entry.name) + 1;
+        if (names_size - names_len < name_size)
+        {
+            size_t new_size = names_size ? names_size : 4096;
+            while (new_size - names_len < name_size)
+                new_size *= 2;
+            char *p = realloc(f->names, new_size);
+            if (p == NULL)
+                return -1;
+            f->names = p;
+            names_size = new_size;
+        }
+        memcpy(f->names + names_len, entry.name, name_size);
+
+        if (f->saved_sb)
+            f->saved_sb[f->n_saved] = sb;
+        struct saved_entry *s = &f->saved[f->n_saved++];
+        s->name = names_len;
+        s->type = entry.type;
+        s->has_sb = known_sb != NULL;
+        if (known_sb)
+        {
+            s->ino = sb.st_ino;
+            s->mode = sb.st_mode;
+            s->dev = sb.st_dev;
+            s->nlink = sb.st_nlink;
+        }
+        else
+            s->ino = entry.ino;
+        names_len += name_size;
+    }
+
+    dir_cursor_close(t, &f->cursor);
+    f->reading = false;
+
+    return 0;
+}
+
+// Reads all remaining entries of a frame's directory into memory and closes the
+// directory. Entries that need to be stat'ed are stat'ed now, so that the
+// directory only has to be reopened to descend into subdirectories.
+// On error, -1 is returned and errno is set.
+static int drain_dir_frame(struct traversal *t, struct dir_frame *f)
+{
+    if (save_dir_frame_entries(t, f, true))
+        return -1;
+    f->fd = -1;
+    t->n_open--;
+
+    return 0;
+}
+
+// Compares two saved directory entries by inode number.
+static int compar_saved_ino(const void *p1, const void *p2)
+{
+    const struct saved_entry *s1 = p1;
+    const struct saved_entry *s2 = p2;
+
+    return (s1->ino > s2->ino) - (s1->ino < s2->ino);
+}
+
+// Closes the open directory that is closest to the root, except for the one of
+// frame <keep>, to free a file descriptor. Directories that have not been read
+// completely are drained first.
+// On error, -1 is returned and errno is set.
+static int evict_dir_frame(struct traversal *t, size_t keep)
+{
+    for (size_t i = 0; i < t->n_frames; i++)
+    {
+        struct dir_frame *f = &t->frames[i];
+        if (i == keep || f->fd == -1)
+            continue;
+
+        if (f->reading)
+            return drain_dir_frame(t, f);
+
+        close(f->fd);
+        f->fd = -1;
+        t->n_open--;
+        return 0;
+    }
+
+    errno = EMFILE;
+    return -1;
+}
+
+// Opens a directory relative to <dir_fd> without exceeding the maximum number of
+// open directories, closing other directories first if necessary. The directory
+// of frame <keep>, which <dir_fd> belongs to, stays open. If the process runs
+// out of file descriptors, the maximum is lowered.
+// On error, -1 is returned and errno is set.
+static int open_frame_dir(struct traversal *t, int dir_fd, const char *name,
+    int open_flags, size_t keep)
+{
+    while (t->n_open >= t->max_open)
+    {
+        if (evict_dir_frame(t, keep))
+            return -1;
+    }
+
+    int fd;
+    while ((fd = openat(dir_fd, name, open_flags)) == -1)
+    {
+        if ((errno != EMFILE && errno != ENFILE) || evict_dir_frame(t, keep))
+            return -1;
+        t->max_open = t->n_open + 1 > 2 ? t->n_open + 1 : 2;
+        DEBUG_PRINTF("Out of file descriptors; keeping at most %zu directories "
+            "open\n", t->max_open);
+    }
+    t->n_open++;
+    COUNT(t, dirs_opened);
+
+    return fd;
+}
+
+// Reopens a closed frame's directory, along with all closed ancestors it is
+// relative to. Each directory must still have the same device and inode number.
+// Returns 0 on success and 1 if the directory can't be reopened because it has
+// been removed or replaced. On other errors, -1 is returned and errno is set.
+static int reopen_dir_frame(struct traversal *t, size_t index)
+{
+    size_t first = index;
+    while (first > 0 && t->frames[first - 1].fd == -1)
+        first--;
+
+    for (size_t i = first; i <= index; i++)
+    {
+        struct dir_frame *f = &t->frames[i];
+        if (f->lost)
+            return 1;
+
+        int fd;
+        if (i == 0)
+        {
+            fd = open_frame_dir(t, t->base_fd, f->path,
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC, SIZE_MAX);
+        }
+        else
+        {
+            fd = open_frame_dir(t, t->frames[i - 1].fd, f->name,
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC
+                | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW), i - 1);
+        }
+
+        if (fd != -1)
+            COUNT(t, stat_calls);
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) || sb.st_dev != f->dev
+            || sb.st_ino != f->ino)
+        {
+            DEBUG_PRINTF("Reopening directory failed: \"%s\"\n", f->path);
+            if (fd != -1)
+            {
+                close(fd);
+                t->n_open--;
+            }
+            else if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP
+                && errno != EACCES)
+            {
+                return -1;
+            }
+            f->lost = true;
+            return 1;
+        }
+        f->fd = fd;
+    }
+
+    return 0;
+}
+
+// Closes a frame's directory, frees its saved entries, and removes it from
+// the directory stack's ancestors.
+static void release_dir_frame(struct traversal *t, struct dir_frame *f)
+{
+    inode_set_remove(&t->ancestors, f->dev, f->ino);
+    if (f->reading)
+    {
+        dir_cursor_close(t, &f->cursor);
+        t->n_open--;
+    }
+    else if (f->fd != -1)
+    {
+        close(f->fd);
+        t->n_open--;
+    }
+    free(f->saved);
+    free(f->saved_sb);
+    free(f->names);
+    ignore_list_free(f->own_ignore);
+}
+
+// Closes a directory that has been opened by push_dir_frame() and frees its
+// path, then returns <ret>. Preserves errno.
+static int discard_frame_dir(struct traversal *t, int fd, char *path, int ret)
+{
+    int saved_errno = errno;
+    close(fd);
+    t->n_open--;
+    free(path);
+    errno = saved_errno;
+    return ret;
+}
+
+// Prepares reading the entries of a frame's directory, whose open file
+// descriptor is <fd> and whose stat information is <sb>. If the cache holds the
+// entries of the unmodified directory, they are copied from there instead of
+// reading the directory; otherwise, they are recorded for the cache while the
+// directory is being read.
+// On error, -1 is returned and errno is set.
+static int open_frame_entries(struct traversal *t, struct dir_frame *f, int fd,
+    const struct stat *sb)
+{
+    f->saved = NULL;
+    f->saved_sb = NULL;
+    f->n_saved = 0;
+    f->pos = 0;
+    f->names = NULL;
+
+    struct cached_dir *dir = t->cache ? cache_lookup(t->cache, sb) : NULL;
+    if (dir)
+    {
+        if (dir->n_entries)
+        {
+            f->saved = malloc(dir->n_entries * sizeof(*f->saved));
+            f->names = malloc(dir->names_len);
+            if (f->saved == NULL || f->names == NULL)
+            {
+                free(f->saved);
+                free(f->names);
+                f->saved = NULL;
+                f->names = NULL;
+                return -1;
+            }
+            memcpy(f->names, dir->names, dir->names_len);
+        }
+        for (size_t i = 0; i < dir->n_entries; i++)
+        {
+            f->saved[i].name = dir->entries[i].name;
+            f->saved[i].ino = dir->entries[i].ino;
+            f->saved[i].type = dir->entries[i].type;
+            f->saved[i].has_sb = false;
+        }
+        f->n_saved = dir->n_entries;
+        f->reading = false;
+        if (t->flags & FL_INODE_ORDER && f->n_saved)
+            qsort(f->saved, f->n_saved, sizeof(*f->saved), compar_saved_ino);
+        return 0;
+    }
+
+    // With FL_INODE_ORDER, the directory's entries are read first, and then
+    // stat'ed and descended into in ascending inode order, which on many file
+    // systems matches their order on disk. The directory stays open.
+    bool inode_order = t->flags & FL_INODE_ORDER;
+    if (dir_cursor_open(t, &f->cursor, fd, inode_order))
+        return -1;
+    f->reading = true;
+    if (t->cache)
+        f->cursor.record = cached_dir_create(t->cache, sb);
+
+    if (inode_order)
+    {
+        if (save_dir_frame_entries(t, f, false))
+        {
+            int saved_errno = errno;
+            dir_cursor_close(t, &f->cursor);
+            free(f->saved);
+            free(f->names);
+            f->saved = NULL;
+            f->names = NULL;
+            errno = saved_errno;
+            return -1;
+        }
+        if (f->n_saved)
+        {
+            qsort(f->saved, f->n_saved, sizeof(*f->saved),
+                compar_saved_ino);
+        }
+    }
+
+    return 0;
+}
+
+// Descends into the subdirectory <name> of the top frame's directory by opening
+// it and pushing a new frame onto the directory stack. The frame owns the path
+// string, even on error. <sb> may be NULL if the directory has not been stat'ed.
+// If <add_path> is true, the path is added to the file list after the directory
+// has been traversed.
+// On error, -1 is returned and errno is set.
+static int push_dir_frame(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path)
+{
+    size_t parent = t->n_frames - 1;
+    int ret = t->frames[parent].fd == -1 ? reopen_dir_frame(t, parent) : 0;
+    int fd = -1;
+    if (ret == 0)
+    {
+        fd = open_frame_dir(t, t->frames[parent].fd, name,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC
+            | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW), parent);
+        if (fd == -1)
+        {
+            DEBUG_PRINTF("openat(): errno %d (%s): \"%s\"\n", errno,
+                strerror(errno), path);
+            ret = errno == EACCES ? 1 : -1;
+        }
+    }
+
+    // Inaccessible directories are still added to the file list, with their
+    // metadata from the parent directory if possible.
+    if (ret)
+    {
+        if (ret == 1 && add_path)
+        {
+            struct stat meta_sb;
+            if (t->meta && !(t->flags & FL_STAT))
+            {
+                struct dir_frame *p = &t->frames[parent];
+                sb = p->fd != -1
+                    && stat_match(t, p->fd, p->path, name, &meta_sb) == 0
+                    ? &meta_sb : NULL;
+            }
+            if ((t->flags & FL_DIR_SEP && append_dir_separator(&path))
+                || add_match(t, &path, 4, sb))
+            {
+                free(path);
+                return -1;
+            }
+            return 0;
+        }
+
+        free(path);
+        return ret == 1 ? 0 : -1;
+    }
+
+    // Check for a loop now if the directory hasn't been stat'ed. The cache
+    // needs the directory's timestamps in any case, and so does metadata
+    // capture, unless FL_STAT is set.
+    bool meta = add_path && t->meta && !(t->flags & FL_STAT);
+    struct stat fd_sb;
+#ifdef FL_INOTIFY
+    if (sb == NULL || t->cache || t->watch || meta)
+#else
+    if (sb == NULL || t->cache || meta)
+#endif
+    {
+        COUNT(t, stat_calls);
+        if (fstat(fd, &fd_sb))
+            return discard_frame_dir(t, fd, path, -1);
+
+        int loop = sb == NULL ? is_traversal_loop(t, NULL, &fd_sb) : 0;
+        if (loop)
+        {
+            if (loop == 1)
+            {
+                DEBUG_PRINTF("Directory loop detected: \"%s\"\n", path);
+                COUNT(t, loops_skipped);
+            }
+            return discard_frame_dir(t, fd, path, loop == 1 ? 0 : -1);
+        }
+        sb = &fd_sb;
+    }
+
+#ifdef FL_INOTIFY
+    // In watch mode, unchanged directories that are watched already are not
+    // traversed again.
+    struct watched_dir *watched = NULL;
+    if (t->watch)
+    {
+        ret = watch_dir(t->watch, fd, path, sb, depth,
+            t->frames[parent].watched, &watched);
+        if (ret == -1)
+            return discard_frame_dir(t, fd, path, -1);
+        if (ret == 1)
+        {
+            close(fd);
+            t->n_open--;
+            if (add_path)
+            {
+                if ((t->flags & FL_DIR_SEP && append_dir_separator(&path))
+                    || add_match(t, &path, 4, sb))
+                {
+                    free(path);
+                    return -1;
+                }
+                return 0;
+            }
+            free(path);
+            return 0;
+        }
+    }
+#endif
+
+    if (t->n_frames == t->frames_size)
+    {
+        size_t new_size = t->frames_size * 2;
+        void *p = realloc(t->frames, new_size * sizeof(*t->frames));
+        if (p == NULL)
+            return discard_frame_dir(t, fd, path, -1);
+        t->frames = p;
+        t->frames_size = new_size;
+    }
+
+    struct dir_frame *f = &t->frames[t->n_frames];
+    const struct ignore_list *ignore = t->frames[parent].ignore;
+    f->own_ignore = NULL;
+    if (t->flags & FL_IGNORE_FILES
+        && load_ignore_list(fd, path, ignore, &f->own_ignore))
+    {
+        return discard_frame_dir(t, fd, path, -1);
+    }
+    if (open_frame_entries(t, f, fd, sb))
+    {
+        DEBUG_PRINTF("dir_reader_open(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), path);
+        ignore_list_free(f->own_ignore);
+        return discard_frame_dir(t, fd, path, -1);
+    }
+    f->path = path;
+    f->name = path + strlen(path) - strlen(name);
+    f->owns_path = true;
+    f->add_path = add_path;
+    f->lost = false;
+    f->fd = fd;
+    f->depth = depth;
+    f->dev = sb->st_dev;
+    f->ino = sb->st_ino;
+    if (add_path && t->meta)
+        f->sb = *sb;
+    f->ignore = f->own_ignore ? f->own_ignore : ignore;
+#ifdef FL_INOTIFY
+    f->watched = watched;
+#endif
+    t->n_frames++;
+    t->n_pushed++;
+#ifndef FL_NO_THREADS
+    if (t->prefetch)
+        prefetch_follow(t->prefetch, f->dev, f->ino);
+#endif
+    if (inode_set_add(&t->ancestors, f->dev, f->ino) == -1)
+        return -1;
+
+    // Iterators yield directories before their contents, and file_list_walk()
+    // yields those that don't match as well, so that they can be skipped.
+    if (t->yield && (add_path || t->yield_dirs))
+    {
+        f->add_path = false;
+        size_t len = strlen(path);
+        char *copy = malloc(len + 2);
+        if (copy == NULL)
+            return -1;
+        memcpy(copy, path, len + 1);
+        if (t->flags & FL_DIR_SEP)
+        {
+            copy[len] = DIR_SEPARATOR;
+            copy[len + 1] = '\0';
+        }
+        if (!add_path)
+        {
+            t->yield->path = copy;
+            t->yield->type = 4;
+            t->yield->has_sb = sb != NULL;
+            t->yield->matches = false;
+            if (sb)
+                t->yield->sb = *sb;
+        }
+        else if (add_match(t, &copy, 4, sb))
+        {
+            free(copy);
+            return -1;
+        }
+        t->yield->pushed = true;
+    }
+
+    return 0;
+}
+
+// Removes the top frame from the directory stack after its directory has been
+// traversed and, if requested, adds the directory to the file list.
+// On error, -1 is returned and errno is set.
+static int pop_dir_frame(struct traversal *t)
+{
+    struct dir_frame *f = &t->frames[--t->n_frames];
+    release_dir_frame(t, f);
+    if (!f->add_path)
+    {
+        if (f->owns_path)
+            free(f->path);
+        return 0;
+    }
+
+    // If requested, add a trailing directory separator.
+    if ((t->flags & FL_DIR_SEP && append_dir_separator(&f->path))
+        || add_match(t, &f->path, 4, t->meta ? &f->sb : NULL))
+    {
+        free(f->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Gets the next entry of the top frame's directory, like dir_cursor_next().
+// Returns -1 on error, with errno set.
+static int dir_frame_next(struct traversal *t, struct dir_frame *f,
+    struct dir_entry *entry, struct stat *sb, struct stat **known_sb)
+{
+    if (f->reading)
+        return dir_cursor_next(t, &f->cursor, f->path, entry, sb, known_sb);
+
+    if (f->pos == f->n_saved)
+        return 0;
+
+    struct saved_entry *s = &f->saved[f->pos++];
+    entry->name = f->names + s->name;
+    entry->ino = s->ino;
+    entry->type = s->type;
+    *known_sb = NULL;
+    if (f->saved_sb)
+    {
+        *sb = f->saved_sb[f->pos - 1];
+        *known_sb = sb;
+    }
+    else if (s->has_sb)
+    {
+        sb->st_mode = s->mode;
+        sb->st_dev = s->dev;
+        sb->st_ino = s->ino;
+        sb->st_nlink = s->nlink;
+        *known_sb = sb;
+    }
+    else if (f->fd == -1 && needs_stat(entry, t->flags))
+    {
+        // Entries from the cache have not been stat'ed yet.
+        int ret = reopen_dir_frame(t, t->n_frames - 1);
+        if (ret)
+            return ret == 1 ? 0 : -1;
+    }
+
+    return 1;
+}
+
+static void dir_stack_free(struct traversal *t);
+
+// Sets up the directory stack for serial traversal, with <directory> as the
+// root frame.
+// <dir_fd> must be an open file descriptor of <directory>, which is relative to
+// t->base_fd; it is closed by dir_stack_free(), or right away on error. <sb> is
+// the directory's stat information.
+// On error, -1 is returned and errno is set.
+static int dir_stack_init(struct traversal *t, int dir_fd,
+    const struct stat *sb, char *directory, int directory_depth)
+{
+    t->frames = malloc(FL_INITIAL_STACK_SIZE * sizeof(*t->frames));
+    if (t->frames == NULL)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    t->frames_size = FL_INITIAL_STACK_SIZE;
+
+    if (t->cache)
+    {
+        t->cache->generation++;
+        t->cache->start_time = time(NULL);
+    }
+
+    struct dir_frame *root = &t->frames[0];
+    root->own_ignore = NULL;
+#ifdef FL_INOTIFY
+    root->watched = NULL;
+    if (t->watch && watch_dir(t->watch, dir_fd, directory, sb,
+        directory_depth, NULL, &root->watched) == -1)
+    {
+        int saved_errno = errno;
+        close(dir_fd);
+        free(t->frames);
+        t->frames = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+#endif
+    if ((t->flags & FL_IGNORE_FILES
+        && load_ignore_list(dir_fd, directory, NULL, &root->own_ignore))
+        || open_frame_entries(t, root, dir_fd, sb))
+    {
+        DEBUG_PRINTF("dir_reader_open(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), directory);
+        int saved_errno = errno;
+        ignore_list_free(root->own_ignore);
+        close(dir_fd);
+        free(t->frames);
+        t->frames = NULL;
+        errno = saved_errno;
+        return -1;
+    }
+    root->path = directory;
+    root->name = NULL;
+    root->owns_path = false;
+    root->add_path = false;
+    root->lost = false;
+    root->fd = dir_fd;
+    root->depth = directory_depth;
+    root->dev = sb->st_dev;
+    root->ino = sb->st_ino;
+    root->ignore = root->own_ignore;
+    t->n_frames = 1;
+    t->n_open = 1;
+    if (inode_set_add(&t->ancestors, root->dev, root->ino) == -1)
+    {
+        dir_stack_free(t);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Processes the top frame's next entry, or pops the frame if there is none.
+// Returns 1 if the traversal continues and 0 if it is complete. On error, -1 is
+// returned and errno is set.
+static int dir_stack_step(struct traversal *t)
+{
+    if (t->n_frames == 0 || t->done)
+        return 0;
+
+    struct dir_frame *f = &t->frames[t->n_frames - 1];
+    struct dir_entry entry;
+    struct stat entry_sb;
+    struct stat *known_sb;
+    int ret = dir_frame_next(t, f, &entry, &entry_sb, &known_sb);
+    if (ret == -1)
+        return -1;
+    if (ret)
+    {
+        t->ignore = f->ignore;
+        if (parse_entry(t, f->fd, f->path, f->depth, &entry, known_sb))
+            return -1;
+    }
+    else if (pop_dir_frame(t))
+        return -1;
+
+    return 1;
+}
+
+// Releases the frames that remain on the directory stack after an error or
+// once the traversal is done, and frees the stack. Preserves errno.
+static void dir_stack_free(struct traversal *t)
+{
+    int saved_errno = errno;
+#ifndef FL_NO_THREADS
+    prefetch_stop(t);
+#endif
+
+    // After a complete traversal, forget directories that no longer exist.
+    if (t->cache && t->frames && t->n_frames == 0)
+        cache_prune(t->cache);
+
+    while (t->n_frames)
+    {
+        struct dir_frame *f = &t->frames[--t->n_frames];
+        release_dir_frame(t, f);
+        if (f->owns_path)
+            free(f->path);
+    }
+    free(t->frames);
+    t->frames = NULL;
+    free(t->ancestors.slots);
+    t->ancestors.slots = NULL;
+    t->ancestors.size = 0;
+    errno = saved_errno;
+}
+
+// Traverses a directory tree to populate a file list, using an explicit stack of
+// directories instead of recursion. At most t->max_open directories are open at
+// the same time; if more are needed, the directories closest to the root are
+// read into memory and closed early.
+// <dir_fd> must be an open file descriptor of <directory>, which is relative to
+// t->base_fd; it is closed before the function returns. <sb> is the directory's
+// stat information. <options> may request prefetching; it may be NULL.
+// On error, -1 is returned and errno is set.
+static int parse_file_tree(struct traversal *t, int dir_fd,
+    const struct stat *sb, char *directory, int directory_depth,
+    const struct fl_options *options)
+{
+    if (dir_stack_init(t, dir_fd, sb, directory, directory_depth))
+        return -1;
+#ifndef FL_NO_THREADS
+    prefetch_start(t, options);
+#else
+    (void) options;
+#endif
+
+    int ret;
+    do
+        ret = dir_stack_step(t);
+    while (ret == 1);
+    dir_stack_free(t);
+
+    return ret;
+}
+
+// Directory prefetching -------------------------------------------------------
+
+#ifndef FL_NO_THREADS
+
+// A helper thread that runs a second serial traversal of the same directory
+// tree a bounded number of directories ahead of the main one. It matches no
+// files and only reads directories, stat'ing no more entries than it needs to
+// find subdirectories, which warms the kernel's caches for the main traversal.
+// Both traversals push mostly the same directories in the same order, so the
+// lead is measured by position: the directories that the prefetcher has pushed
+// after the one the main traversal has pushed last. If the main traversal
+// pushes a directory that the prefetcher hasn't, the prefetcher is either
+// behind or the tree has changed; it may then push up to <window> directories
+// to catch up before the window applies again. Subtrees that the main
+// traversal skips (see file_list_walk()) or ignores (FL_IGNORE_FILES) are left
+// by the prefetcher as well.
+struct prefetch
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct traversal t;
+    int file_type_arr[13];   // All 0.
+    regex_t exclude;
+    bool has_exclude;
+    struct inode_set visited;
+    size_t window;           // The maximum lead, in directories.
+    struct file_id *ahead;   // The directories that the prefetcher has pushed
+                             // and the main traversal hasn't yet, in order.
+    size_t head;
+    size_t tail;
+    size_t ahead_size;       // The array's maximum size.
+    struct file_id entered;  // The directory that the main traversal has
+                             // pushed last if the prefetcher hasn't.
+    size_t n_catch_up;       // The number of directories that the prefetcher
+                             // may still push to reach <entered>; 0 if the
+                             // prefetcher is not behind.
+    struct inode_set skipped; // Directories whose subtrees the main traversal
+                              // has skipped.
+    size_t n_skips;          // Incremented whenever a subtree is skipped.
+    int stop;
+};
+
+static int open_start_dir(int dirfd, const char *start_dir, struct stat *sb);
+static int get_regex_flags(int flags);
+
+// Frees a prefetcher whose traversal has not been set up or has been cleaned
+// up.
+static void prefetch_free(struct prefetch *pf)
+{
+    if (pf->has_exclude)
+        regfree(&pf->exclude);
+    free(pf->visited.slots);
+    free(pf->ahead);
+    free(pf->skipped.slots);
+    free(pf);
+}
+
+// Records that the prefetcher has pushed a directory, which counts as ahead of
+// the main traversal until the main traversal pushes it or a directory after
+// it. Must be called with the prefetcher's lock held.
+// Returns -1 on error, otherwise 0.
+static int prefetch_push(struct prefetch *pf, dev_t dev, ino_t ino)
+{
+    if (pf->n_catch_up)
+    {
+        // Once the prefetcher has caught up, the directories it has pushed
+        // before have all been passed.
+        if (pf->entered.dev == dev && pf->entered.ino == ino)
+        {
+            pf->head = pf->tail = 0;
+            pf->n_catch_up = 0;
+            return 0;
+        }
+        pf->n_catch_up--;
+
+        // While catching up, the oldest directories have most likely been
+        // passed, too.
+        if (pf->tail - pf->head >= 2 * pf->window)
+            pf->head++;
+    }
+
+    if (pf->tail == pf->ahead_size)
+    {
+        if (pf->head > 0) // Reclaim space of directories entered since.
+        {
+            memmove(pf->ahead, pf->ahead + pf->head,
+                (pf->tail - pf->head) * sizeof(*pf->ahead));
+            pf->tail -= pf->head;
+            pf->head = 0;
+        }
+        else
+        {
+            size_t new_size = pf->ahead_size ? pf->ahead_size * 2 : 64;
+            void *p = realloc(pf->ahead, new_size * sizeof(*pf->ahead));
+            if (p == NULL)
+                return -1;
+            pf->ahead = p;
+            pf->ahead_size = new_size;
+        }
+    }
+
+    pf->ahead[pf->tail++] = (struct file_id) { dev, ino, true };
+    return 0;
+}
+
+// Runs the prefetcher's traversal until it is complete or stopped, pausing
+// whenever it is pf->window directories ahead of the main traversal, and
+// leaving subtrees that the main traversal has skipped.
+static void *prefetch_main(void *arg)
+{
+    struct prefetch *pf = arg;
+    struct traversal *t = &pf->t;
+    size_t n_skips = 0;
+    int ret = 1;
+    while (ret == 1 && !__atomic_load_n(&pf->stop, __ATOMIC_RELAXED))
+    {
+        size_t n_pushed = t->n_pushed;
+        ret = dir_stack_step(t);
+        if (ret != 1 || t->n_pushed == n_pushed)
+            continue;
+
+        const struct dir_frame *top = &t->frames[t->n_frames - 1];
+        pthread_mutex_lock(&pf->lock);
+        if (prefetch_push(pf, top->dev, top->ino))
+            ret = -1;
+        while (ret == 1 && !pf->stop && pf->n_skips == n_skips
+            && pf->n_catch_up == 0 && pf->tail - pf->head >= pf->window)
+        {
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        }
+
+        // Only the new directory can have been skipped, unless subtrees have
+        // been skipped since the last check.
+        size_t i = pf->n_skips == n_skips ? t->n_frames - 1 : 1;
+        n_skips = pf->n_skips;
+        while (i < t->n_frames && !inode_set_contains(&pf->skipped,
+            t->frames[i].dev, t->frames[i].ino))
+        {
+            i++;
+        }
+        pthread_mutex_unlock(&pf->lock);
+        while (ret == 1 && t->n_frames > i)
+        {
+            if (pop_dir_frame(t))
+                ret = -1;
+        }
+    }
+    if (ret == -1)
+    {
+        DEBUG_PRINTF("Prefetching failed: errno %d (%s)\n", errno,
+            strerror(errno));
+    }
+
+    // Close the prefetcher's directories right away.
+    dir_stack_free(t);
+
+    return NULL;
+}
+
+// Starts prefetching for the serial traversal <t>, whose directory stack has
+// just been set up, if <options> requests it. Failing to start is not an
+// error; the traversal just goes without prefetching.
+static void prefetch_start(struct traversal *t,
+    const struct fl_options *options)
+{
+    // Cached directories need no reading.
+    if (options == NULL || options->prefetch_dirs <= 0 || t->cache)
+        return;
+
+    struct prefetch *pf = calloc(1, sizeof(*pf));
+    if (pf == NULL)
+        return;
+    pf->window = options->prefetch_dirs;
+
+    const struct dir_frame *root = &t->frames[0];
+    struct traversal *p = &pf->t;
+    p->file_type_arr = pf->file_type_arr;
+    p->root_dev = t->root_dev;
+    p->base_fd = t->base_fd;
+    p->max_open = t->max_open;
+    p->visited = t->visited ? &pf->visited : NULL;
+    // Ignored directories are reported by the main traversal as skipped.
+    p->flags = t->flags & ~(FL_STAT | FL_IGNORE_FILES);
+    if (options->exclude_dirs)
+    {
+        if (regcomp(&pf->exclude, options->exclude_dirs,
+            get_regex_flags(t->flags)))
+        {
+            prefetch_free(pf);
+            return;
+        }
+        pf->has_exclude = true;
+        p->exclude = &pf->exclude;
+    }
+
+    // The start directory is opened again, since a duplicated file descriptor
+    // would share the main traversal's position in the directory.
+    struct stat sb;
+    int dir_fd = -1;
+    if ((p->visited && inode_set_add(p->visited, root->dev, root->ino) == -1)
+        || (dir_fd = open_start_dir(t->base_fd, root->path, &sb)) == -1)
+    {
+        prefetch_free(pf);
+        return;
+    }
+    if (sb.st_dev != root->dev || sb.st_ino != root->ino)
+    {
+        close(dir_fd);
+        prefetch_free(pf);
+        return;
+    }
+
+    traversal_setup(p);
+    if (dir_stack_init(p, dir_fd, &sb, root->path, root->depth))
+    {
+        traversal_cleanup(p);
+        prefetch_free(pf);
+        return;
+    }
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if (pthread_create(&pf->thread, NULL, prefetch_main, pf))
+    {
+        DEBUG_PRINTF("pthread_create(): Prefetching disabled\n");
+        dir_stack_free(p);
+        traversal_cleanup(p);
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->cond);
+        prefetch_free(pf);
+        return;
+    }
+    t->prefetch = pf;
+}
+
+// Tells the prefetcher that the main traversal has pushed the directory <dev>,
+// <ino>. The prefetcher's directories up to it are not ahead anymore. If the
+// prefetcher hasn't pushed the directory, it may push up to pf->window
+// directories to catch up.
+static void prefetch_follow(struct prefetch *pf, dev_t dev, ino_t ino)
+{
+    pthread_mutex_lock(&pf->lock);
+    size_t i = pf->head;
+    while (i < pf->tail && (pf->ahead[i].dev != dev || pf->ahead[i].ino != ino))
+        i++;
+    if (i < pf->tail)
+    {
+        pf->head = i + 1;
+        pf->n_catch_up = 0;
+        if (pf->head == pf->tail)
+            pf->head = pf->tail = 0;
+    }
+    else
+    {
+        pf->entered = (struct file_id) { dev, ino, true };
+        pf->n_catch_up = pf->window;
+    }
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+// Tells the prefetcher that the main traversal has skipped the subtree of the
+// directory <dev>, <ino>, so that the prefetcher doesn't read it in vain.
+static void prefetch_skip(struct prefetch *pf, dev_t dev, ino_t ino)
+{
+    pthread_mutex_lock(&pf->lock);
+    if (inode_set_add(&pf->skipped, dev, ino) == 1)
+    {
+        pf->n_skips++;
+        pthread_cond_signal(&pf->cond);
+    }
+    pthread_mutex_unlock(&pf->lock);
+}
+
+// Stops and frees the prefetcher of the traversal <t>, if any. Preserves errno.
+static void prefetch_stop(struct traversal *t)
+{
+    struct prefetch *pf = t->prefetch;
+    if (pf == NULL)
+        return;
+
+    int saved_errno = errno;
+    pthread_mutex_lock(&pf->lock);
+    __atomic_store_n(&pf->stop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    traversal_cleanup(&pf->t);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    prefetch_free(pf);
+    t->prefetch = NULL;
+    errno = saved_errno;
+}
+
+#endif
+
+// Breadth-first traversal -----------------------------------------------------
+
+// A FIFO queue of directories for breadth-first traversal. Directories are
+// closed after they have been parsed. Since all subdirectories of a directory
+// are queued one after another, the directory is reopened only once to open
+// them.
+struct dir_queue
+{
+    size_t head;
+    size_t tail;
+    size_t size;         // The array's maximum size.
+    struct dir_node **nodes;
+    struct dir_node *root;
+    struct dir_node *reopened; // The most recently reopened directory.
+};
+
+// Adds a directory node to the end of a queue.
+// Returns -1 on error, otherwise 0.
+static int dir_queue_push(struct dir_queue *queue, struct dir_node *node)
+{
+    if (queue->tail == queue->size)
+    {
+        if (queue->head > 0) // Reclaim space of removed nodes.
+        {
+            memmove(queue->nodes, queue->nodes + queue->head,
+                (queue->tail - queue->head) * sizeof(struct dir_node *));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        else
+        {
+            size_t new_size = queue->size ? queue->size * 2 : 64;
+            void *p = realloc(queue->nodes,
+                new_size * sizeof(struct dir_node *));
+            if (p == NULL)
+                return -1;
+            queue->nodes = p;
+            queue->size = new_size;
+        }
+    }
+
+    queue->nodes[queue->tail++] = node;
+    return 0;
+}
+
+// Removes the first directory node from a queue.
+// Returns NULL if the queue is empty.
+static struct dir_node *dir_queue_pop(struct dir_queue *queue)
+{
+    if (queue->head == queue->tail)
+        return NULL;
+
+    struct dir_node *node = queue->nodes[queue->head++];
+    if (queue->head == queue->tail)
+        queue->head = queue->tail = 0;
+
+    return node;
+}
+
+// Queues the subdirectory <name> of the directory that is currently being
+// parsed. The node owns the path string, even on error. If <add_path> is true,
+// the path is added to the file list right away, so that the file list's order
+// is strictly by level.
+// On error, -1 is returned and errno is set.
+static int queue_dir_node(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path)
+{
+    struct dir_node *node = dir_node_create(t->node, path, name, sb, depth,
+        false);
+    if (node == NULL)
+        return -1;
+    t->node->refs++;
+
+    if (dir_queue_push(t->queue, node))
+    {
+        dir_node_release(node);
+        return -1;
+    }
+
+    // If requested, add a trailing directory separator.
+    if (add_path)
+    {
+        if ((t->flags & FL_DIR_SEP && append_dir_separator(&node->path))
+            || add_match(t, &node->path, 4, sb))
+        {
+            return -1;
+        }
+        node->owns_path = false;
+    }
+
+    return 0;
+}
+
+// Opens a directory node by walking down from its nearest open ancestor, for
+// paths that are too long to be opened at once.
+// Returns the file descriptor, or -1 on error, with errno set.
+static int open_dir_node_stepwise(struct traversal *t, struct dir_node *node)
+{
+    size_t n = 0;
+    struct dir_node *ancestor;
+    for (ancestor = node; ancestor->fd == -1; ancestor = ancestor->parent)
+        n++;
+
+    struct dir_node **chain = malloc(n * sizeof(struct dir_node *));
+    if (chain == NULL)
+        return -1;
+    size_t i = n;
+    for (struct dir_node *p = node; p != ancestor; p = p->parent)
+        chain[--i] = p;
+
+    int fd = ancestor->fd;
+    for (i = 0; i < n; i++)
+    {
+        int next_fd = openat(fd, chain[i]->name,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC
+            | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW));
+        if (fd != ancestor->fd)
+            close(fd);
+        fd = next_fd;
+        if (fd == -1)
+            break;
+    }
+    free(chain);
+
+    return fd;
+}
+
+// Reopens a directory node that has already been parsed, to open its
+// subdirectories. The previously reopened directory is closed. The directory
+// must still have the same device and inode number.
+// Returns 0 on success and 1 if the directory can't be reopened because it has
+// been removed or replaced. On other errors, -1 is returned and errno is set.
+static int reopen_dir_node(struct traversal *t, struct dir_node *node)
+{
+    struct dir_queue *queue = t->queue;
+    if (queue->reopened)
+    {
+        close(queue->reopened->fd);
+        queue->reopened->fd = -1;
+        dir_node_release(queue->reopened);
+        queue->reopened = NULL;
+    }
+
+    int fd = openat(t->base_fd, node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+        | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW));
+    if (fd == -1 && errno == ENAMETOOLONG)
+        fd = open_dir_node_stepwise(t, node);
+    if (fd != -1)
+    {
+        COUNT(t, dirs_opened);
+        COUNT(t, stat_calls);
+    }
+
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) || sb.st_dev != node->dev
+        || sb.st_ino != node->ino)
+    {
+        DEBUG_PRINTF("Reopening directory failed: \"%s\"\n", node->path);
+        if (fd != -1)
+            close(fd);
+        else if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP
+            && errno != EACCES)
+        {
+            return -1;
+        }
+        return 1;
+    }
+
+    node->fd = fd;
+    node->refs++;
+    queue->reopened = node;
+
+    return 0;
+}
+
+// Opens and parses a queued directory node's entries, then closes it again.
+// On error, -1 is returned and errno is set.
+static int parse_queued_dir_node(struct traversal *t, struct dir_node *node)
+{
+    if (node->fd == -1)
+    {
+        struct dir_node *parent = node->parent;
+        if (parent->fd == -1)
+        {
+            int ret = reopen_dir_node(t, parent);
+            if (ret)
+                return ret == 1 ? 0 : -1;
+        }
+
+        node->fd = openat(parent->fd, node->name,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC
+            | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW));
+        if (node->fd == -1)
+        {
+            DEBUG_PRINTF("openat(): errno %d (%s): \"%s\"\n", errno,
+                strerror(errno), node->path);
+            return errno == EACCES ? 0 : -1;
+        }
+        COUNT(t, dirs_opened);
+
+        // Ignore the directory if it has been replaced since it was stat'ed.
+        struct stat sb;
+        COUNT(t, stat_calls);
+        if (fstat(node->fd, &sb))
+            return -1;
+        if (sb.st_dev != node->dev || sb.st_ino != node->ino)
+        {
+            DEBUG_PRINTF("Directory has changed: \"%s\"\n", node->path);
+            close(node->fd);
+            node->fd = -1;
+            return 0;
+        }
+    }
+
+    struct dir_cursor cursor;
+    if (load_node_ignore_list(t, node)
+        || dir_cursor_open(t, &cursor, node->fd, true))
+    {
+        DEBUG_PRINTF("dir_reader_open(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), node->path);
+        return -1;
+    }
+
+    t->node = node;
+    t->ignore = node->ignore;
+    int ret = 0;
+    struct dir_entry entry;
+    struct stat sb;
+    struct stat *known_sb;
+    while (!t->done
+        && dir_cursor_next(t, &cursor, node->path, &entry, &sb, &known_sb))
+    {
+        if (parse_entry(t, node->fd, node->path, node->depth, &entry,
+            known_sb))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    dir_cursor_close(t, &cursor);
+    if (node != t->queue->root)
+    {
+        close(node->fd);
+        node->fd = -1;
+    }
+    errno = saved_errno;
+    return ret;
+}
+
+// Traverses a directory tree breadth-first, level by level, to populate a file
+// list. Apart from the start directory, at most 2 directories are open at the
+// same time.
+// <dir_fd> must be an open file descriptor of <directory>, which is relative to
+// t->base_fd; it is closed before the function returns. <sb> is the directory's
+// stat information.
+// On error, -1 is returned and errno is set.
+static int parse_file_tree_bfs(struct traversal *t, int dir_fd,
+    const struct stat *sb, char *directory, int directory_depth)
+{
+    struct dir_queue queue = { 0 };
+    queue.root = malloc(sizeof(*queue.root) + 1);
+    if (queue.root == NULL)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    queue.root->parent = NULL;
+    queue.root->path = directory;
+    queue.root->owns_path = false;
+    queue.root->add_path = false;
+    queue.root->has_id = true;
+    queue.root->fd = dir_fd;
+    queue.root->depth = directory_depth;
+    queue.root->refs = 1;
+    queue.root->dev = sb->st_dev;
+    queue.root->ino = sb->st_ino;
+    queue.root->ignore = NULL;
+    queue.root->own_ignore = NULL;
+    queue.root->name[0] = '\0';
+    t->queue = &queue;
+
+    int ret = 0;
+    struct dir_node *node = queue.root;
+    queue.root->refs++; // Keeps the start directory open.
+    do
+    {
+        ret = parse_queued_dir_node(t, node);
+        dir_node_release(node);
+    }
+    while (ret == 0 && !t->done && (node = dir_queue_pop(&queue)) != NULL);
+
+    // After an error or once done, release the remaining nodes.
+    int saved_errno = errno;
+    while ((node = dir_queue_pop(&queue)) != NULL)
+        dir_node_release(node);
+    if (queue.reopened)
+        dir_node_release(queue.reopened);
+    dir_node_release(queue.root);
+    free(queue.nodes);
+    t->queue = NULL;
+    t->node = NULL;
+    errno = saved_errno;
+
+    return ret;
+}
+
+// Parallel traversal ----------------------------------------------------------
+
+#ifndef FL_NO_THREADS
+
+// The maximum number of threads for parallel traversal. Can be changed
+// arbitrarily.
+#define FL_MAX_THREADS 256
+
+// A work-stealing deque. Its owner pushes and pops tasks at the bottom, while
+// other threads steal the oldest tasks from the top.
+struct deque
+{
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+    size_t size;         // The array's maximum size.
+    struct dir_node **tasks;
+};
+
+// State shared by all threads of a parallel traversal.
+struct parallel
+{
+    pthread_mutex_t lock; // Protects the members below and all node refs.
+    pthread_cond_t cond;
+    size_t pending;      // Tasks that have been created but not finished.
+    size_t queued;       // Tasks that are waiting in a deque.
+    int idle;            // Threads waiting for new tasks.
+    int error;           // The errno value of the first error, or 0.
+    int n_workers;
+    struct worker *workers;
+};
+
+// A thread of a parallel traversal with its own file list.
+struct worker
+{
+    pthread_t thread;
+    int index;
+    struct parallel *shared;
+    struct deque deque;
+    struct traversal t;
+    char **file_list;
+    size_t n_file_list;
+    size_t n_file_list_max;
+    struct path_arena arena;
+    struct meta_table meta;
+    struct fl_stats stats;
+    regex_t regex;
+    regex_t exclude;
+};
+
+// Adds a task to the bottom of a deque.
+// Returns -1 on error, otherwise 0.
+static int deque_push(struct deque *deque, struct dir_node *node)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->bottom == deque->size)
+    {
+        if (deque->top > 0) // Reclaim space of stolen tasks.
+        {
+            memmove(deque->tasks, deque->tasks + deque->top,
+                (deque->bottom - deque->top) * sizeof(struct dir_node *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        else
+        {
+            size_t new_size = deque->size ? deque->size * 2 : 64;
+            void *p = realloc(deque->tasks,
+                new_size * sizeof(struct dir_node *));
+            if (p == NULL)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->tasks = p;
+            deque->size = new_size;
+        }
+    }
+
+    deque->tasks[deque->bottom++] = node;
+
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// Takes the newest task from a deque, or the oldest one if <steal> is true.
+// Returns NULL if the deque is empty.
+static struct dir_node *deque_take(struct deque *deque, bool steal)
+{
+    struct dir_node *node = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top != deque->bottom)
+    {
+        if (steal)
+            node = deque->tasks[deque->top++];
+        else
+            node = deque->tasks[--deque->bottom];
+
+        if (deque->top == deque->bottom)
+            deque->top = deque->bottom = 0;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return node;
+}
+
+// Creates a task for a subdirectory of the directory that is currently being
+// parsed and adds it to the thread's deque. The task owns the path string, even
+// on error. <sb> may be NULL if the directory has not been stat'ed. If
+// <add_path> is true, the path is added to the file list when the task is
+// processed.
+// On error, -1 is returned and errno is set.
+static int push_dir_node(struct traversal *t, char *path, const char *name,
+    const struct stat *sb, int depth, bool add_path)
+{
+    struct parallel *p = t->worker->shared;
+
+    struct dir_node *node = dir_node_create(t->node, path, name, sb, depth,
+        add_path);
+    if (node == NULL)
+        return -1;
+
+    // Account for the task before it can be stolen.
+    pthread_mutex_lock(&p->lock);
+    t->node->refs++;
+    p->pending++;
+    p->queued++;
+    if (p->idle)
+        pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    if (deque_push(&t->worker->deque, node))
+    {
+        pthread_mutex_lock(&p->lock);
+        p->queued--;
+        p->pending--;
+        dir_node_release(node);
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns the next task for a thread, taken from its own deque or stolen from
+// other threads' deques. Waits if there are no queued tasks but other threads
+// may still create some. Returns NULL when all tasks are finished.
+static struct dir_node *worker_get_task(struct worker *w)
+{
+    struct parallel *p = w->shared;
+
+    for (;;)
+    {
+        struct dir_node *node = deque_take(&w->deque, false);
+        for (int i = 1; node == NULL && i < p->n_workers; i++)
+        {
+            struct worker *victim = &p->workers[(w->index + i) % p->n_workers];
+            node = deque_take(&victim->deque, true);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (node)
+        {
+            p->queued--;
+            pthread_mutex_unlock(&p->lock);
+            return node;
+        }
+
+        while (p->queued == 0 && p->pending > 0)
+        {
+            p->idle++;
+            pthread_cond_wait(&p->cond, &p->lock);
+            p->idle--;
+        }
+
+        if (p->pending == 0)
+        {
+            pthread_mutex_unlock(&p->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+}
+
+// Adds a directory node's path to the thread's file list. <sb> may be NULL if
+// the directory has not been stat'ed.
+// On error, -1 is returned and errno is set.
+static int add_node_path(struct traversal *t, struct dir_node *node,
+    const struct stat *sb)
+{
+    if (add_match(t, &node->path, 4, sb))
+        return -1;
+    node->owns_path = false;
+
+    return 0;
+}
+
+// Opens and parses a directory node's entries.
+// On error, -1 is returned and errno is set.
+static int parse_dir_node(struct traversal *t, struct dir_node *node)
+{
+    // Metadata is captured from the parent directory for inaccessible
+    // directories, otherwise with a single fstat() after opening them.
+    bool meta = node->add_path && t->meta && !(t->flags & FL_STAT);
+    struct stat node_sb;
+    bool have_sb = false;
+    if (node->fd == -1)
+    {
+        node->fd = openat(node->parent->fd, node->name,
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC
+            | (t->flags & FL_FOLLOW_LINKS ? 0 : O_NOFOLLOW));
+        if (node->fd == -1)
+        {
+            DEBUG_PRINTF("openat(): errno %d (%s): \"%s\"\n", errno,
+                strerror(errno), node->path);
+            if (errno != EACCES)
+                return -1;
+            if (!node->add_path)
+                return 0;
+            have_sb = meta && stat_match(t, node->parent->fd,
+                node->parent->path, node->name, &node_sb) == 0;
+            return add_node_path(t, node, have_sb ? &node_sb : NULL);
+        }
+        COUNT(t, dirs_opened);
+
+        // Check for a loop now if the directory hasn't been stat'ed.
+        if (!node->has_id || meta)
+        {
+            COUNT(t, stat_calls);
+            if (fstat(node->fd, &node_sb))
+                return -1;
+            have_sb = meta;
+        }
+        if (!node->has_id)
+        {
+            int loop = is_traversal_loop(t, node->parent, &node_sb);
+            if (loop == -1)
+                return -1;
+            if (loop)
+            {
+                DEBUG_PRINTF("Directory loop detected: \"%s\"\n",
+                    node->path);
+                COUNT(t, loops_skipped);
+                return 0;
+            }
+            node->dev = node_sb.st_dev;
+            node->ino = node_sb.st_ino;
+            node->has_id = true;
+        }
+    }
+
+    if (node->add_path
+        && add_node_path(t, node, have_sb ? &node_sb : NULL))
+    {
+        return -1;
+    }
+
+    struct dir_cursor cursor;
+    if (load_node_ignore_list(t, node)
+        || dir_cursor_open(t, &cursor, node->fd, true))
+    {
+        DEBUG_PRINTF("dir_reader_open(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), node->path);
+        return -1;
+    }
+
+    t->node = node;
+    t->ignore = node->ignore;
+    int ret = 0;
+    struct dir_entry entry;
+    struct stat sb;
+    struct stat *known_sb;
+    while (!t->done
+        && dir_cursor_next(t, &cursor, node->path, &entry, &sb, &known_sb))
+    {
+        if (parse_entry(t, node->fd, node->path, node->depth, &entry,
+            known_sb))
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    int saved_errno = errno;
+    dir_cursor_close(t, &cursor);
+    errno = saved_errno;
+    return ret;
+}
+
+// A parallel traversal thread's main loop.
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct parallel *p = w->shared;
+    bool stop = false;
+
+    struct dir_node *node;
+    while ((node = worker_get_task(w)) != NULL)
+    {
+        // After an error or once the budget is exhausted, remaining tasks are
+        // only discarded.
+        int ret = stop ? 0 : parse_dir_node(&w->t, node);
+
+        // Entries that are left after each directory go back to the budget,
+        // since there may be no more work for this thread.
+        if (w->t.budget)
+        {
+            pthread_mutex_lock(&w->t.budget->lock);
+            budget_give_back(&w->t);
+            pthread_mutex_unlock(&w->t.budget->lock);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (ret && p->error == 0)
+            p->error = errno ? errno : EIO;
+        stop = p->error != 0 || w->t.done;
+        dir_node_release(node);
+        if (--p->pending == 0)
+            pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    return NULL;
+}
+
+// Traverses a directory tree with multiple threads, each of which collects its
+// own file list. The lists are then merged into the file list of <base>.
+// <dir_fd> is closed before the function returns.
+// On error, -1 is returned and errno is set.
+static int parse_file_tree_parallel(struct traversal *base, int dir_fd,
+    struct stat *sb, char *directory, int directory_depth, int n_threads,
+    const char *regex_pattern, const char *exclude_pattern, int regex_flags)
+{
+    struct parallel p = { .n_workers = n_threads };
+    p.workers = calloc(n_threads, sizeof(struct worker));
+    if (p.workers == NULL)
+    {
+        close(dir_fd);
+        return -1;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if (base->inodes)
+        pthread_mutex_init(&base->inodes->lock, NULL);
+    if (base->visited)
+        pthread_mutex_init(&base->visited->lock, NULL);
+    if (base->budget)
+    {
+        pthread_mutex_init(&base->budget->lock, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&base->budget->given_back, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    // Set up each thread's state.
+    int n_ready;
+    for (n_ready = 0; n_ready < n_threads; n_ready++)
+    {
+        struct worker *w = &p.workers[n_ready];
+        w->index = n_ready;
+        w->shared = &p;
+        w->file_list = malloc(FL_INITIAL_LIST_SIZE * sizeof(char *));
+        if (w->file_list == NULL)
+            break;
+        w->n_file_list_max = FL_INITIAL_LIST_SIZE;
+        if (regex_pattern && regcomp(&w->regex, regex_pattern, regex_flags))
+        {
+            free(w->file_list);
+            break;
+        }
+        if (exclude_pattern
+            && regcomp(&w->exclude, exclude_pattern, regex_flags))
+        {
+            free(w->file_list);
+            if (regex_pattern)
+                regfree(&w->regex);
+            break;
+        }
+        pthread_mutex_init(&w->deque.lock, NULL);
+
+        w->t = *base;
+        w->t.file_list = &w->file_list;
+        w->t.n_file_list = &w->n_file_list;
+        w->t.n_file_list_max = &w->n_file_list_max;
+        w->t.file_ext = regex_pattern ? &w->regex : NULL;
+        w->t.exclude = exclude_pattern ? &w->exclude : NULL;
+        if (base->meta)
+        {
+            w->meta.m.fields = base->meta->m.fields;
+            w->t.meta = &w->meta;
+        }
+        if (base->stats)
+            w->t.stats = &w->stats;
+        if (base->arena)
+            w->t.arena = &w->arena;
+        w->t.worker = w;
+        traversal_setup(&w->t);
+    }
+
+    // Queue the start directory as the first task.
+    struct dir_node *root = NULL;
+    if (n_ready == n_threads)
+        root = malloc(sizeof(*root) + 1);
+    if (root == NULL)
+    {
+        close(dir_fd);
+        p.error = ENOMEM;
+    }
+    else
+    {
+        root->parent = NULL;
+        root->path = directory;
+        root->owns_path = false;
+        root->add_path = false;
+        root->has_id = true;
+        root->fd = dir_fd;
+        root->depth = directory_depth;
+        root->refs = 1;
+        root->dev = sb->st_dev;
+        root->ino = sb->st_ino;
+        root->ignore = NULL;
+        root->own_ignore = NULL;
+        root->name[0] = '\0';
+        p.pending = p.queued = 1;
+        if (deque_push(&p.workers[0].deque, root))
+        {
+            p.error = ENOMEM;
+            dir_node_release(root);
+        }
+        else
+        {
+            // The calling thread is the first worker.
+            int n_started = 1;
+            for (; n_started < n_threads; n_started++)
+            {
+                if (pthread_create(&p.workers[n_started].thread, NULL,
+                    worker_main, &p.workers[n_started]))
+                {
+                    DEBUG_PRINTF("pthread_create(): Using %d threads\n",
+                        n_started);
+                    break;
+                }
+            }
+            worker_main(&p.workers[0]);
+            for (int i = 1; i < n_started; i++)
+                pthread_join(p.workers[i].thread, NULL);
+        }
+    }
+
+    // Merge the threads' file lists.
+    size_t total = *base->n_file_list;
+    for (int i = 0; i < n_ready; i++)
+        total += p.workers[i].n_file_list;
+    if (total > FL_MAX_LIST_SIZE)
+    {
+        total = FL_MAX_LIST_SIZE;
+        if (p.error == 0)
+            p.error = E2BIG;
+    }
+    if (total > *base->n_file_list_max)
+    {
+        char **list = realloc(*base->file_list, total * sizeof(char *));
+        if (list == NULL)
+        {
+            total = *base->n_file_list;
+            p.error = ENOMEM;
+        }
+        else
+        {
+            *base->file_list = list;
+            *base->n_file_list_max = total;
+            COUNT(base, list_reallocs);
+        }
+    }
+    if (base->meta && meta_reserve(base->meta, total))
+    {
+        total = *base->n_file_list;
+        p.error = ENOMEM;
+    }
+    for (int i = 0; i < n_ready; i++)
+    {
+        struct worker *w = &p.workers[i];
+        size_t n = w->n_file_list;
+        if (n > total - *base->n_file_list)
+            n = total - *base->n_file_list;
+        memcpy(*base->file_list + *base->n_file_list, w->file_list,
+            n * sizeof(char *));
+        if (base->meta)
+            meta_copy(base->meta, *base->n_file_list, &w->meta, n);
+        *base->n_file_list += n;
+        if (base->arena)
+            arena_adopt(base->arena, &w->arena);
+        else
+        {
+            for (size_t j = n; j < w->n_file_list; j++)
+                free(w->file_list[j]);
+        }
+        free(w->file_list);
+        meta_free(&w->meta.m);
+        if (base->stats)
+            stats_add(base->stats, &w->stats);
+
+        traversal_cleanup(&w->t);
+        if (regex_pattern)
+            regfree(&w->regex);
+        if (exclude_pattern)
+            regfree(&w->exclude);
+        free(w->deque.tasks);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+    free(p.workers);
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    if (base->inodes)
+        pthread_mutex_destroy(&base->inodes->lock);
+    if (base->visited)
+        pthread_mutex_destroy(&base->visited->lock);
+    if (base->budget)
+    {
+        pthread_mutex_destroy(&base->budget->lock);
+        pthread_cond_destroy(&base->budget->given_back);
+    }
+
+    if (n_ready < n_threads && p.error == 0)
+        p.error = ENOMEM;
+    if (p.error)
+    {
+        errno = p.error;
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
+
+// Public functions ------------------------------------------------------------
+
+// Fills a file type lookup array, whose indexes are DT_ values from dirent.h,
+// according to file_list_create()'s parameter <file_type>.
+static void set_file_type_arr(int file_type_arr[13], int file_type)
+{
+    for (int i = 0; i < 13; i++)
+        file_type_arr[i] = file_type == 0;
+    if (file_type & FL_UNKNOWN)
+        file_type_arr[0] = 1;
+    if (file_type & FL_FIFO)
+        file_type_arr[1] = 1;
+    if (file_type & FL_CHR)
+        file_type_arr[2] = 1;
+    if (file_type & FL_DIR)
+        file_type_arr[4] = 1;
+    if (file_type & FL_BLK)
+        file_type_arr[6] = 1;
+    if (file_type & FL_REG)
+        file_type_arr[8] = 1;
+    if (file_type & FL_LNK)
+        file_type_arr[10] = 1;
+    if (file_type & FL_SOCK)
+        file_type_arr[12] = 1;
+}
+
+// Returns the regcomp() flags that correspond to file_list_create()'s flags.
+static int get_regex_flags(int flags)
+{
+    int regex_flags = REG_NOSUB;
+    if (flags)
+    {
+        if (!(flags & FL_REGEX_BASIC))
+            regex_flags |= REG_EXTENDED;
+        if (!(flags & FL_REGEX_CASE))
+            regex_flags |= REG_ICASE;
+    }
+
+    return regex_flags;
+}
+
+// Opens the start directory <start_dir> relative to <dirfd> and retrieves its
+// stat information.
+// On error, -1 is returned and errno is set.
+static int open_start_dir(int dirfd, const char *start_dir, struct stat *sb)
+{
+    int dir_fd = openat(dirfd, start_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+    {
+        DEBUG_PRINTF("openat(): errno %d (%s): \"%s\"\n", errno,
+            strerror(errno), start_dir);
+        return -1;
+    }
+
+    if (fstat(dir_fd, sb))
+    {
+        int saved_errno = errno;
+        close(dir_fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return dir_fd;
+}
+
+// Returns the maximum number of open directories for serial traversal.
+static size_t get_max_open_dirs(const struct fl_options *options)
+{
+    if (options == NULL || options->max_open_dirs <= 0)
+        return FL_MAX_OPEN_DIRS;
+
+    return options->max_open_dirs < 2 ? 2 : (size_t) options->max_open_dirs;
+}
+
+ssize_t file_list_create_ex(char ***file_list, int file_type,
+    const char *regex_pattern, int dirfd, const char *dir, int depth,
+    int flags, enum FL_SORT_METHOD sort_method,
+    const struct fl_options *options)
+{
+#ifndef FL_NO_THREADS
+    // Determine the number of threads.
+    int n_threads = options ? options->threads : 0;
+    if (n_threads == -1)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? n_cpus : 1;
+    }
+    if (n_threads > FL_MAX_THREADS)
+        n_threads = FL_MAX_THREADS;
+
+    // Breadth-first traversal, inode order, match limits, and caches need a
+    // single thread.
+    if (flags & (FL_BREADTH_FIRST | FL_INODE_ORDER)
+        || (options && (options->max_matches || options->cache)))
+    {
+        n_threads = 1;
+    }
+#endif
+
+    struct fl_metadata *metadata = options ? options->metadata : NULL;
+    struct meta_table meta = { 0 };
+    if (metadata && metadata->fields)
+    {
+        meta.m.fields = metadata->fields;
+        *metadata = meta.m;
+    }
+    else
+        metadata = NULL;
+
+    // Allocate initial memory for file list.
+    *file_list = malloc(FL_INITIAL_LIST_SIZE * sizeof(char *));
+    if (*file_list == NULL)
+        return -1;
+    size_t file_list_size = 0;
+    size_t file_list_size_max = FL_INITIAL_LIST_SIZE;
+
+    // Create file type lookup array.
+    int file_type_arr[13];
+    set_file_type_arr(file_type_arr, file_type);
+
+    // Compile regular expressions.
+    regex_t regex;
+    int regex_flags = get_regex_flags(flags);
+    if (regex_pattern)
+    {
+        if (regcomp(&regex, regex_pattern, regex_flags))
+        {
+            free(*file_list);
+            return -1;
+        }
+    }
+    regex_t exclude;
+    const char *exclude_pattern = options ? options->exclude_dirs : NULL;
+    if (exclude_pattern)
+    {
+        if (regcomp(&exclude, exclude_pattern, regex_flags))
+        {
+            free(*file_list);
+            if (regex_pattern)
+                regfree(&regex);
+            return -1;
+        }
+    }
+
+    struct fl_stats *stats = options ? options->stats : NULL;
+    double start_time = 0;
+    if (stats)
+    {
+        *stats = (struct fl_stats) { 0 };
+        start_time = monotonic_time();
+    }
+
+    // Strip superfluous directory separators.
+    char *start_dir = create_clean_dir(dir);
+
+    // Open the start directory. If it is not accessible, the file list stays
+    // empty.
+    struct stat sb;
+    int dir_fd = -1;
+    if (start_dir)
+        dir_fd = open_start_dir(dirfd, start_dir, &sb);
+    if (stats && dir_fd != -1)
+    {
+        stats->dirs_opened++;
+        stats->stat_calls++;
+    }
+    if (dir_fd == -1 && (start_dir == NULL || errno != EACCES))
+    {
+        free(*file_list);
+        if (regex_pattern)
+            regfree(&regex);
+        if (exclude_pattern)
+            regfree(&exclude);
+        free(start_dir);
+        return -1;
+    }
+
+    // Populate file list.
+    int ret = 0;
+    enum FL_STATUS status = FL_STATUS_COMPLETE;
+    struct inode_set inodes = { 0 };
+    struct inode_set visited = { 0 };
+    struct budget budget;
+    struct path_arena arena = { 0 };
+    if (dir_fd != -1 && flags & FL_UNIQUE_DIRS
+        && inode_set_add(&visited, sb.st_dev, sb.st_ino) == -1)
+    {
+        close(dir_fd);
+        ret = -1;
+    }
+    else if (dir_fd != -1)
+    {
+        struct traversal t = {
+            .file_list = file_list,
+            .n_file_list = &file_list_size,
+            .n_file_list_max = &file_list_size_max,
+            .file_type_arr = file_type_arr,
+            .file_ext = regex_pattern ? &regex : NULL,
+            .exclude = exclude_pattern ? &exclude : NULL,
+            .root_dev = sb.st_dev,
+            .base_fd = dirfd,
+            .cache = options ? options->cache : NULL,
+            .meta = metadata ? &meta : NULL,
+            .inodes = flags & FL_UNIQUE_INODES ? &inodes : NULL,
+            .visited = flags & FL_UNIQUE_DIRS ? &visited : NULL,
+            .max_matches = options ? options->max_matches : 0,
+            .budget = budget_init(&budget, options),
+            .stats = stats,
+            .arena = &arena,
+            .flags = flags,
+        };
+
+#ifndef FL_NO_THREADS
+        if (n_threads > 1)
+        {
+            ret = parse_file_tree_parallel(&t, dir_fd, &sb, start_dir, depth,
+                n_threads, regex_pattern, exclude_pattern, regex_flags);
+        }
+        else
+#endif
+        {
+            t.max_open = get_max_open_dirs(options);
+            traversal_setup(&t);
+            if (flags & FL_BREADTH_FIRST)
+                ret = parse_file_tree_bfs(&t, dir_fd, &sb, start_dir, depth);
+            else
+                ret = parse_file_tree(&t, dir_fd, &sb, start_dir, depth,
+                    options);
+            traversal_cleanup(&t);
+        }
+        status = traversal_status(&t);
+    }
+    if (stats)
+        stats->traverse_time = monotonic_time() - start_time;
+    free(inodes.slots);
+    free(visited.slots);
+    if (regex_pattern)
+        regfree(&regex);
+    if (exclude_pattern)
+        regfree(&exclude);
+    free(start_dir);
+    if (ret && errno != E2BIG)
+    {
+        arena_free(&arena);
+        free(*file_list);
+        *file_list = NULL;
+        meta_free(&meta.m);
+        return -1;
+    }
+
+    // Trim file list and make it NULL-terminated.
+    if (stats)
+        start_time = monotonic_time();
+    char **p = finish_file_list(*file_list, file_list_size, &arena);
+    if (p)
+        *file_list = p;
+    else
+    {
+        int saved_errno = errno;
+        arena_free(&arena);
+        free(*file_list);
+        *file_list = NULL;
+        meta_free(&meta.m);
+        errno = saved_errno;
+        return -1;
+    }
+    if (stats)
+    {
+        stats->trim_time = monotonic_time() - start_time;
+        start_time = monotonic_time();
+    }
+
+    // Sort file list, along with its metadata.
+    int (*compar_fn)(const void *, const void *) = get_compar_fn(sort_method);
+    if (metadata)
+    {
+        if (sort_file_list_meta(*file_list, file_list_size, compar_fn, &meta))
+        {
+            int saved_errno = errno;
+            file_list_destroy(file_list);
+            meta_free(&meta.m);
+            errno = saved_errno;
+            return -1;
+        }
+        *metadata = meta.m;
+    }
+    else if (compar_fn)
+        qsort(*file_list, file_list_size, sizeof(char *), compar_fn);
+    if (stats)
+        stats->sort_time = monotonic_time() - start_time;
+
+    if (options && options->status)
+        *options->status = status;
+
+    return file_list_size;
+}
+
+ssize_t file_list_create_at(char ***file_list, int file_type,
+    const char *regex_pattern, int dirfd, const char *dir, int depth,
+    int flags, enum FL_SORT_METHOD sort_method)
+{
+    return file_list_create_ex(file_list, file_type, regex_pattern, dirfd,
+        dir, depth, flags, sort_method, NULL);
+}
+
+ssize_t file_list_create(char ***file_list, int file_type,
+    const char *regex_pattern, const char *dir, int depth, int flags,
+    enum FL_SORT_METHOD sort_method)
+{
+    return file_list_create_at(file_list, file_type, regex_pattern, AT_FDCWD,
+        dir, depth, flags, sort_method);
+}
+
+// State of a directory tree iterator. The traversal is the same as
+// file_list_create_ex()'s serial traversal, but each step is driven by
+// file_list_iter_next(), which stops as soon as a match has been yielded.
+struct fl_iter
+{
+    struct traversal t;
+    struct match match;  // The most recently yielded match.
+    struct inode_set inodes;
+    struct inode_set visited;
+    struct budget budget;
+    enum FL_STATUS *status; // Receives the status once there are no more files.
+    int file_type_arr[13];
+    regex_t regex;
+    bool has_regex;
+    regex_t exclude;
+    bool has_exclude;
+    char *start_dir;
+    bool failed;         // An error has occurred.
+};
+
+struct fl_iter *file_list_iter_open(int file_type, const char *regex_pattern,
+    int dirfd, const char *dir, int depth, int flags,
+    const struct fl_options *options)
+{
+    if (flags & FL_BREADTH_FIRST)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct fl_iter *iter = calloc(1, sizeof(*iter));
+    if (iter == NULL)
+        return NULL;
+    set_file_type_arr(iter->file_type_arr, file_type);
+    iter->status = options ? options->status : NULL;
+    if (options && options->stats)
+        *options->stats = (struct fl_stats) { 0 };
+
+    if (regex_pattern)
+    {
+        if (regcomp(&iter->regex, regex_pattern, get_regex_flags(flags)))
+        {
+            free(iter);
+            return NULL;
+        }
+        iter->has_regex = true;
+    }
+    if (options && options->exclude_dirs)
+    {
+        if (regcomp(&iter->exclude, options->exclude_dirs,
+            get_regex_flags(flags)))
+        {
+            file_list_iter_close(iter);
+            return NULL;
+        }
+        iter->has_exclude = true;
+    }
+
+    iter->start_dir = create_clean_dir(dir);
+    if (iter->start_dir == NULL)
+    {
+        file_list_iter_close(iter);
+        return NULL;
+    }
+
+    // If the start directory is not accessible, there are no files.
+    struct stat sb;
+    int dir_fd = open_start_dir(dirfd, iter->start_dir, &sb);
+    if (dir_fd == -1)
+    {
+        if (errno == EACCES)
+            return iter;
+        file_list_iter_close(iter);
+        return NULL;
+    }
+
+    struct traversal *t = &iter->t;
+    t->file_type_arr = iter->file_type_arr;
+    t->file_ext = iter->has_regex ? &iter->regex : NULL;
+    t->exclude = iter->has_exclude ? &iter->exclude : NULL;
+    t->root_dev = sb.st_dev;
+    t->max_open = get_max_open_dirs(options);
+    t->base_fd = dirfd;
+    t->cache = options ? options->cache : NULL;
+    t->inodes = flags & FL_UNIQUE_INODES ? &iter->inodes : NULL;
+    t->visited = flags & FL_UNIQUE_DIRS ? &iter->visited : NULL;
+    if (t->visited && inode_set_add(t->visited, sb.st_dev, sb.st_ino) == -1)
+    {
+        close(dir_fd);
+        file_list_iter_close(iter);
+        return NULL;
+    }
+    t->yield = &iter->match;
+    t->max_matches = options ? options->max_matches : 0;
+    t->budget = budget_init(&iter->budget, options);
+    t->stats = options ? options->stats : NULL;
+    if (t->stats)
+    {
+        t->stats->dirs_opened = 1;
+        t->stats->stat_calls = 1;
+    }
+    t->flags = flags;
+    traversal_setup(t);
+    if (dir_stack_init(t, dir_fd, &sb, iter->start_dir, depth))
+    {
+        traversal_cleanup(t);
+        file_list_iter_close(iter);
+        return NULL;
+    }
+#ifndef FL_NO_THREADS
+    prefetch_start(t, options);
+#endif
+
+    return iter;
+}
+
+int file_list_iter_next(struct fl_iter *iter, struct fl_entry *entry)
+{
+    // Converts .d_type values to file types.
+    static const int fl_types[13] = {
+        FL_UNKNOWN, FL_FIFO, FL_CHR, FL_UNKNOWN, FL_DIR, FL_UNKNOWN, FL_BLK,
+        FL_UNKNOWN, FL_REG, FL_UNKNOWN, FL_LNK, FL_UNKNOWN, FL_SOCK,
+    };
+
+    if (iter->failed)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The previous match's path is only valid until now.
+    free(iter->match.path);
+    iter->match.path = NULL;
+
+    int ret;
+    do
+        ret = dir_stack_step(&iter->t);
+    while (ret == 1 && iter->match.path == NULL);
+
+#ifndef FL_NO_THREADS
+    // The prefetcher is not needed anymore.
+    if (ret != 1)
+        prefetch_stop(&iter->t);
+#endif
+    if (ret == -1)
+    {
+        iter->failed = true;
+        return -1;
+    }
+    if (iter->match.path == NULL)
+    {
+        if (iter->status)
+            *iter->status = traversal_status(&iter->t);
+        return 0;
+    }
+
+    entry->path = iter->match.path;
+    entry->type = iter->match.type < 13 ? fl_types[iter->match.type]
+        : FL_UNKNOWN;
+    entry->sb = iter->t.flags & FL_STAT && iter->match.has_sb
+        ? &iter->match.sb : NULL;
+    entry->matches = iter->match.matches;
+
+    return 1;
+}
+
+void file_list_iter_close(struct fl_iter *iter)
+{
+    if (iter == NULL)
+        return;
+
+    int saved_errno = errno;
+    if (iter->t.frames)
+    {
+        dir_stack_free(&iter->t);
+        traversal_cleanup(&iter->t);
+    }
+    free(iter->match.path);
+    free(iter->inodes.slots);
+    free(iter->visited.slots);
+    if (iter->has_regex)
+        regfree(&iter->regex);
+    if (iter->has_exclude)
+        regfree(&iter->exclude);
+    free(iter->start_dir);
+    free(iter);
+    errno = saved_errno;
+}
+
+ssize_t file_list_walk(int file_type, const char *regex_pattern, int dirfd,
+    const char *dir, int depth, int flags, fl_walk_fn callback, void *ctx,
+    const struct fl_options *options)
+{
+    struct fl_iter *iter = file_list_iter_open(file_type, regex_pattern, dirfd,
+        dir, depth, flags, options);
+    if (iter == NULL)
+        return -1;
+    iter->t.yield_dirs = true;
+
+    ssize_t n = 0;
+    int ret;
+    struct fl_entry entry;
+    while ((ret = file_list_iter_next(iter, &entry)) == 1)
+    {
+        n++;
+        int action = callback(&entry, ctx);
+        if (action == FL_WALK_STOP)
+            break;
+
+        // Leave the directory before any of its entries have been read.
+        if (action == FL_WALK_SKIP_SUBTREE && iter->match.pushed)
+        {
+#ifndef FL_NO_THREADS
+            if (iter->t.prefetch)
+            {
+                const struct dir_frame *f =
+                    &iter->t.frames[iter->t.n_frames - 1];
+                prefetch_skip(iter->t.prefetch, f->dev, f->ino);
+            }
+#endif
+            if (pop_dir_frame(&iter->t))
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    file_list_iter_close(iter);
+
+    return ret == -1 ? -1 : n;
+}
+
+// A file or directory of a compact file list.
+struct compact_node
+{
+    uint32_t parent;     // The parent directory's index, or UINT32_MAX.
+    uint32_t name;       // The name's offset in the list's names.
+};
+
+// A compact file list. Its files and the directories that contain them are
+// stored as nodes in the order they are found, with the start directory at
+// index 0, whose name is its path. A matching directory is stored only once, as
+// a file, which is also the parent of its contents. Directories that are not
+// files themselves are listed in <dirs>, so that the files can be indexed.
+struct fl_compact
+{
+    struct compact_node *nodes;
+    size_t n_nodes;
+    size_t nodes_size;
+    uint32_t *dirs;      // The ascending indexes of nodes that aren't files.
+    size_t n_dirs;
+    size_t dirs_size;
+    char *names;         // NUL-terminated names, one after another.
+    size_t names_len;
+    size_t names_size;
+};
+
+// Adds a node with the first <len> characters of <name> to a compact file
+// list. Unless <is_file>, the node is only a directory that contains files.
+// On error, -1 is returned and errno is set. The errno value EOVERFLOW means
+// that the list has reached its maximum size.
+static int compact_add(struct fl_compact *list, uint32_t parent,
+    const char *name, size_t len, bool is_file)
+{
+    // UINT32_MAX is reserved for the start directory's parent.
+    if (list->n_nodes >= UINT32_MAX || list->names_len > UINT32_MAX)
+    {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    struct compact_node *p = grow_array(list->nodes, list->n_nodes,
+        &list->nodes_size, sizeof(*list->nodes));
+    if (p == NULL)
+        return -1;
+    list->nodes = p;
+    if (!is_file)
+    {
+        uint32_t *d = grow_array(list->dirs, list->n_dirs, &list->dirs_size,
+            sizeof(*list->dirs));
+        if (d == NULL)
+            return -1;
+        list->dirs = d;
+    }
+
+    if (list->names_size - list->names_len < len + 1)
+    {
+        size_t new_size = list->names_size ? list->names_size : 4096;
+        while (new_size - list->names_len < len + 1)
+            new_size *= 2;
+        char *names = realloc(list->names, new_size);
+        if (names == NULL)
+            return -1;
+        list->names = names;
+        list->names_size = new_size;
+    }
+    memcpy(list->names + list->names_len, name, len);
+    list->names[list->names_len + len] = '\0';
+
+    p[list->n_nodes].parent = parent;
+    p[list->n_nodes].name = (uint32_t) list->names_len;
+    if (!is_file)
+        list->dirs[list->n_dirs++] = (uint32_t) list->n_nodes;
+    list->n_nodes++;
+    list->names_len += len + 1;
+
+    return 0;
+}
+
+// Returns true if a compact file list's node name <name> is the first <len>
+// characters of <s>. A trailing directory separator (FL_DIR_SEP) of the name
+// is ignored.
+static bool compact_name_equals(const char *name, const char *s, size_t len)
+{
+    return strncmp(name, s, len) == 0 && (name[len] == '\0'
+        || (name[len] == DIR_SEPARATOR && name[len + 1] == '\0'));
+}
+
+// Adds a path found by an iterator, which starts with the iterator's start
+// directory, to a compact file list. <stack> holds the indexes of the nodes
+// along the previous path, starting with the start directory; its directories
+// are reused as far as they match. Since the iterator returns directories
+// before their contents, a matching directory is the parent of the paths that
+// follow it.
+// On error, -1 is returned and errno is set.
+static int compact_add_path(struct fl_compact *list, const char *path,
+    size_t root_len, uint32_t **stack, size_t *n_stack, size_t *stack_size)
+{
+    const char *p = path + root_len;
+    if (*p == DIR_SEPARATOR)
+        p++;
+
+    // Find or add the path's directories, level by level.
+    size_t level = 1;
+    const char *sep;
+    while ((sep = strchr(p, DIR_SEPARATOR)) && sep[1] != '\0')
+    {
+        size_t len = sep - p;
+        if (level >= *n_stack || !compact_name_equals(
+            list->names + list->nodes[(*stack)[level]].name, p, len))
+        {
+            uint32_t *s = grow_array(*stack, level, stack_size,
+                sizeof(**stack));
+            if (s == NULL)
+                return -1;
+            *stack = s;
+            if (compact_add(list, s[level - 1], p, len, false))
+                return -1;
+            s[level] = (uint32_t) list->n_nodes - 1;
+            *n_stack = level + 1;
+        }
+        level++;
+        p = sep + 1;
+    }
+
+    // The file's name keeps a trailing directory separator (FL_DIR_SEP). Any
+    // file may be a directory that contains the following paths.
+    uint32_t *s = grow_array(*stack, level, stack_size, sizeof(**stack));
+    if (s == NULL)
+        return -1;
+    *stack = s;
+    if (compact_add(list, s[level - 1], p, strlen(p), true))
+        return -1;
+    s[level] = (uint32_t) list->n_nodes - 1;
+    *n_stack = level + 1;
+
+    return 0;
+}
+
+struct fl_compact *file_list_create_compact(int file_type,
+    const char *regex_pattern, int dirfd, const char *dir, int depth,
+    int flags, const struct fl_options *options)
+{
+    struct fl_iter *iter = file_list_iter_open(file_type, regex_pattern, dirfd,
+        dir, depth, flags, options);
+    if (iter == NULL)
+        return NULL;
+
+    uint32_t *stack = NULL;
+    size_t n_stack = 0;
+    size_t stack_size = 0;
+    struct fl_compact *list = calloc(1, sizeof(*list));
+    const char *root = iter->start_dir;
+    int ret = -1;
+    if (list && compact_add(list, UINT32_MAX, root, strlen(root), false) == 0
+        && (stack = grow_array(NULL, 0, &stack_size, sizeof(*stack))))
+    {
+        stack[0] = 0;
+        n_stack = 1;
+        size_t root_len = strlen(root);
+        struct fl_entry entry;
+        while ((ret = file_list_iter_next(iter, &entry)) == 1)
+        {
+            if (compact_add_path(list, entry.path, root_len, &stack, &n_stack,
+                &stack_size))
+            {
+                ret = -1;
+                break;
+            }
+        }
+    }
+
+    int saved_errno = errno;
+    free(stack);
+    file_list_iter_close(iter);
+    if (ret)
+    {
+        file_list_compact_destroy(list);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    // Trim the arrays. Shrinking them cannot fail in practice, and if it does,
+    // they just keep their size.
+    void *p;
+    if ((p = realloc(list->nodes, list->n_nodes * sizeof(*list->nodes))))
+    {
+        list->nodes = p;
+        list->nodes_size = list->n_nodes;
+    }
+    if ((p = realloc(list->dirs, list->n_dirs * sizeof(*list->dirs))))
+    {
+        list->dirs = p;
+        list->dirs_size = list->n_dirs;
+    }
+    if ((p = realloc(list->names, list->names_len)))
+    {
+        list->names = p;
+        list->names_size = list->names_len;
+    }
+
+    return list;
+}
+
+size_t file_list_compact_size(const struct fl_compact *list)
+{
+    return list->n_nodes - list->n_dirs;
+}
+
+// Returns the node index of a compact file list's file <i>. The files before
+// directory node dirs[k] number dirs[k] - k, so file i comes after the k
+// directories for which that number is at most i.
+static size_t compact_file_node(const struct fl_compact *list, size_t i)
+{
+    size_t lo = 0;
+    size_t hi = list->n_dirs;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->dirs[mid] - mid <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return i + lo;
+}
+
+// Copies <n> characters of <s> to buf[pos], leaving out those that do not fit
+// into <size> - 1 bytes.
+static void put_path_part(char *buf, size_t size, size_t pos, const char *s,
+    size_t n)
+{
+    if (pos + 1 >= size)
+        return;
+    if (n > size - 1 - pos)
+        n = size - 1 - pos;
+    memcpy(buf + pos, s, n);
+}
+
+size_t file_list_compact_path(const struct fl_compact *list, size_t i,
+    char *buf, size_t size)
+{
+    // Measure the path, then build it from its end.
+    const struct compact_node *file = &list->nodes[compact_file_node(list, i)];
+    const char *name = list->names + file->name;
+    size_t name_len = strlen(name);
+    size_t len = name_len;
+    for (uint32_t d = file->parent; d != UINT32_MAX; d = list->nodes[d].parent)
+    {
+        const char *dir_name = list->names + list->nodes[d].name;
+        size_t n = strlen(dir_name);
+        len += n + (dir_name[n - 1] != DIR_SEPARATOR);
+    }
+
+    size_t pos = len - name_len;
+    put_path_part(buf, size, pos, name, name_len);
+    for (uint32_t d = file->parent; d != UINT32_MAX; d = list->nodes[d].parent)
+    {
+        const char *dir_name = list->names + list->nodes[d].name;
+        size_t n = strlen(dir_name);
+        if (dir_name[n - 1] != DIR_SEPARATOR)
+        {
+            char sep = DIR_SEPARATOR;
+            put_path_part(buf, size, --pos, &sep, 1);
+        }
+        pos -= n;
+        put_path_part(buf, size, pos, dir_name, n);
+    }
+    if (size)
+        buf[len < size ? len : size - 1] = '\0';
+
+    return len;
+}
+
+void file_list_compact_destroy(struct fl_compact *list)
+{
+    if (list == NULL)
+        return;
+
+    free(list->nodes);
+    free(list->dirs);
+    free(list->names);
+    free(list);
+}
+
+struct fl_cache *file_list_cache_create(void)
+{
+    return calloc(1, sizeof(struct fl_cache));
+}
+
+void file_list_cache_destroy(struct fl_cache *cache)
+{
+    if (cache == NULL)
+        return;
+
+    for (size_t i = 0; i < cache->size; i++)
+        cached_dir_free(cache->slots[i]);
+    free(cache->slots);
+    free(cache);
+}
+
+#ifdef FL_INOTIFY
+
+// Compares two paths with strcmp(), unlike qsort_compar_ascii(), which compares
+// the paths' directories first. In this order, all paths inside a directory are
+// adjacent.
+static int compar_path(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *) p1, *(char *const *) p2);
+}
+
+// Returns the index of the first path in a strcmp()-sorted array that is not
+// less than <s>.
+static size_t find_path(char **paths, size_t n, const char *s)
+{
+    size_t lo = 0;
+    size_t hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(paths[mid], s) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Returns true if <path> is inside one of the current rescan's unchanged
+// directories, whose contents have not been read again. Since none of these
+// directories is inside another one, the nearest preceding prefix is the only
+// candidate.
+static bool is_kept_path(const struct fl_watch *w, const char *path)
+{
+    char **kept = w->kept.paths;
+    size_t i = find_path(kept, w->kept.n, path);
+    if (i < w->kept.n && strcmp(kept[i], path) == 0)
+        return false; // The directory itself (with FL_DIR_SEP).
+    if (i == 0)
+        return false;
+
+    return strncmp(kept[i - 1], path, strlen(kept[i - 1])) == 0;
+}
+
+// Reads a watched directory again, along with all of its subdirectories that
+// are new or have changed, and compares the files that are found to those in
+// the file list. Unchanged subdirectories are skipped.
+// <dir_fd> must be an open file descriptor of <directory>, which is relative to
+// the watch's base directory; it is closed before the function returns. <sb> is
+// the directory's stat information.
+// The paths of new files are added to <added>, which owns them, and those of
+// files that are gone are added to <removed>, while still being owned by the
+// file list.
+// On error, -1 is returned and errno is set.
+static int scan_watched_dir(struct fl_watch *w, int dir_fd,
+    const struct stat *sb, char *directory, int depth,
+    struct path_array *added, struct path_array *removed)
+{
+    w->generation++;
+    w->n_visited = 0;
+    for (size_t i = 0; i < w->kept.n; i++)
+        free(w->kept.paths[i]);
+    w->kept.n = 0;
+
+    char *prefix = create_path(directory, "");
+    char **found = malloc(FL_INITIAL_LIST_SIZE * sizeof(char *));
+    if (prefix == NULL || found == NULL)
+    {
+        close(dir_fd);
+        free(prefix);
+        free(found);
+        return -1;
+    }
+    size_t n_found = 0;
+    size_t n_found_max = FL_INITIAL_LIST_SIZE;
+
+    struct traversal t = {
+        .file_list = &found,
+        .n_file_list = &n_found,
+        .n_file_list_max = &n_found_max,
+        .file_type_arr = w->file_type_arr,
+        .file_ext = w->has_regex ? &w->regex : NULL,
+        .exclude = w->has_exclude ? &w->exclude : NULL,
+        .watch = w,
+        .root_dev = w->root_dev,
+        .max_open = w->max_open,
+        .base_fd = w->base_fd,
+        .flags = w->flags,
+    };
+    traversal_setup(&t);
+    int ret = parse_file_tree(&t, dir_fd, sb, directory, depth, NULL);
+    traversal_cleanup(&t);
+
+    // Compare the files to the file list's files inside the directory, except
+    // for those inside unchanged subdirectories.
+    size_t i = 0;
+    if (ret == 0)
+    {
+        if (n_found)
+            qsort(found, n_found, sizeof(char *), compar_path);
+        path_array_sort(&w->kept, compar_path);
+
+        size_t prefix_len = strlen(prefix);
+        size_t j = find_path(w->index, w->n, prefix);
+        while (true)
+        {
+            char *old = j < w->n
+                && strncmp(w->index[j], prefix, prefix_len) == 0
+                ? w->index[j] : NULL;
+            if (old && (old[prefix_len] == '\0' || is_kept_path(w, old)))
+            {
+                j++;
+                continue;
             }
-            else
+            char *new = i < n_found ? found[i] : NULL;
+            if (old == NULL && new == NULL)
+                break;
+
+            int cmp = old == NULL ? 1 : new == NULL ? -1 : strcmp(old, new);
+            if (cmp < 0)
             {
-                if (stat_stack_push(stack, &sb))
+                if (path_array_add(removed, old))
                 {
-                    free(current_path);
-                    closedir(dir);
-                    return -1;
+                    ret = -1;
+                    break;
                 }
+                j++;
+            }
+            else if (cmp > 0)
+            {
+                if (path_array_add(added, new))
+                {
+                    ret = -1;
+                    break;
+                }
+                i++;
+            }
+            else
+            {
+                free(new);
+                i++;
+                j++;
+            }
+        }
+    }
+
+    // Stop watching subdirectories that have not been found again.
+    if (ret == 0)
+    {
+        for (size_t k = 0; k < w->n_visited; k++)
+        {
+            struct watched_dir *d = w->visited[k];
+            for (size_t l = d->n_children; l-- > 0;)
+            {
+                if (d->children[l]->generation != w->generation)
+                    remove_watched_dir(w, d->children[l], true);
+            }
+        }
+    }
+
+    int saved_errno = errno;
+    for (; i < n_found; i++)
+        free(found[i]);
+    free(found);
+    free(prefix);
+    errno = saved_errno;
+
+    return ret;
+}
+
+// Reads a changed watched directory again, like scan_watched_dir(). Does
+// nothing if the directory has been removed or replaced in the meantime, which
+// is handled when its parent is read again.
+// On error, -1 is returned and errno is set.
+static int rescan_watched_dir(struct fl_watch *w, struct watched_dir *d,
+    struct path_array *added, struct path_array *removed)
+{
+    int fd = openat(w->base_fd, d->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+        | (d->parent && !(w->flags & FL_FOLLOW_LINKS) ? O_NOFOLLOW : 0));
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) || sb.st_dev != d->dev
+        || sb.st_ino != d->ino)
+    {
+        DEBUG_PRINTF("Reopening directory failed: \"%s\"\n", d->path);
+        if (fd != -1)
+            close(fd);
+        else if (errno != ENOENT && errno != ENOTDIR && errno != ELOOP
+            && errno != EACCES)
+        {
+            return -1;
+        }
+        d->dirty = false;
+        return 0;
+    }
+
+    return scan_watched_dir(w, fd, &sb, d->path, d->depth, added, removed);
+}
+
+// Compares two pointers, for sorting and searching arrays of paths by address.
+static int compar_address(const void *p1, const void *p2)
+{
+    uintptr_t a = (uintptr_t) *(char *const *) p1;
+    uintptr_t b = (uintptr_t) *(char *const *) p2;
+
+    return (a > b) - (a < b);
+}
+
+// Returns true if <path> is an element of a path array sorted by address.
+static bool is_removed_path(const struct path_array *removed, char *path)
+{
+    return removed->n && bsearch(&path, removed->paths, removed->n,
+        sizeof(char *), compar_address);
+}
+
+// Merges the sorted arrays <a> and <b> into <dest>, omitting elements of <a>
+// that are in <removed>.
+static void merge_paths(char **dest, char **a, size_t n_a, char **b,
+    size_t n_b, const struct path_array *removed,
+    int (*compar_fn)(const void *, const void *))
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < n_a || j < n_b)
+    {
+        if (i < n_a && is_removed_path(removed, a[i]))
+            i++;
+        else if (j == n_b
+            || (i < n_a && (compar_fn == NULL || compar_fn(&a[i], &b[j]) <= 0)))
+        {
+            *dest++ = a[i++];
+        }
+        else
+            *dest++ = b[j++];
+    }
+}
+
+// Creates a NULL-terminated file list from copies of the paths in a path array.
+// On error, NULL is returned and errno is set.
+static char **create_change_list(const struct path_array *a)
+{
+    char **paths = malloc((a->n + 1) * sizeof(char *));
+    if (paths == NULL)
+        return NULL;
+
+    struct path_arena arena = { 0 };
+    size_t i = 0;
+    while (i < a->n && (paths[i] = arena_strdup(&arena, a->paths[i])) != NULL)
+        i++;
+    char **list = i == a->n ? finish_file_list(paths, a->n, &arena) : NULL;
+    if (list == NULL)
+    {
+        int saved_errno = errno;
+        arena_free(&arena);
+        free(paths);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return list;
+}
+
+// Applies the changes found by scan_watched_dir() to a watch's file list. The
+// file list takes ownership of the added paths, while the removed paths are
+// freed. <added_list> and <removed_list> receive copies of the added and
+// removed paths, if not NULL. Both lists are in the file list's sort order.
+// On error, -1 is returned, errno is set, and the file list is unchanged.
+static int apply_watch_changes(struct fl_watch *w, struct path_array *added,
+    struct path_array *removed, char ***added_list, char ***removed_list)
+{
+    size_t n = w->n - removed->n + added->n;
+    if (n > FL_MAX_LIST_SIZE)
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    // Without changes, the file list is kept as it is.
+    char **index = w->index;
+    char **list = w->list;
+    bool changed = added->n || removed->n;
+    if (changed)
+    {
+        path_array_sort(added, compar_path);
+        path_array_sort(removed, compar_address);
+
+        index = malloc(n * sizeof(char *));
+        list = malloc((n + 1) * sizeof(char *));
+        if (index == NULL || list == NULL)
+        {
+            free(index);
+            free(list);
+            return -1;
+        }
+        merge_paths(index, w->index, w->n, added->paths, added->n, removed,
+            compar_path);
+
+        // Without a sort method, new files are appended.
+        if (w->compar_fn)
+            path_array_sort(added, w->compar_fn);
+        merge_paths(list, w->list, w->n, added->paths, added->n, removed,
+            w->compar_fn);
+        list[n] = NULL;
+        if (w->compar_fn)
+            path_array_sort(removed, w->compar_fn);
+    }
+
+    char **a_list = NULL;
+    char **r_list = NULL;
+    if ((added_list && (a_list = create_change_list(added)) == NULL)
+        || (removed_list && (r_list = create_change_list(removed)) == NULL))
+    {
+        int saved_errno = errno;
+        file_list_destroy(&a_list);
+        if (changed)
+        {
+            free(index);
+            free(list);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (added_list)
+        *added_list = a_list;
+    if (removed_list)
+        *removed_list = r_list;
+    for (size_t i = 0; i < removed->n; i++)
+        free(removed->paths[i]);
+    if (changed)
+    {
+        free(w->index);
+        free(w->list);
+        w->index = index;
+        w->list = list;
+        w->n = n;
+    }
+
+    return 0;
+}
+
+// A changed directory, along with its path's length.
+struct dirty_dir
+{
+    size_t len;
+    int wd;
+};
+
+// Compares two changed directories by path length.
+static int compar_dirty_dir(const void *p1, const void *p2)
+{
+    const struct dirty_dir *a = p1;
+    const struct dirty_dir *b = p2;
+
+    return (a->len > b->len) - (a->len < b->len);
+}
+
+// Reads all changed directories of a watch again. If the start directory is
+// gone, all files are removed.
+// On error, -1 is returned and errno is set.
+static int rescan_dirty_dirs(struct fl_watch *w, struct path_array *added,
+    struct path_array *removed)
+{
+    if (w->root == NULL)
+    {
+        for (size_t i = 0; i < w->n; i++)
+        {
+            if (path_array_add(removed, w->index[i]))
+                return -1;
+        }
+        w->n_dirty = 0;
+        return 0;
+    }
+
+    // Ancestors are read first, which reads their changed descendants as well.
+    struct dirty_dir *dirs = malloc((w->n_dirty ? w->n_dirty : 1)
+        * sizeof(*dirs));
+    if (dirs == NULL)
+        return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < w->n_dirty; i++)
+    {
+        size_t pos;
+        if (find_watched_dir(w, w->dirty[i], &pos))
+        {
+            dirs[n].len = strlen(w->dirs[pos]->path);
+            dirs[n++].wd = w->dirty[i];
+        }
+    }
+    w->n_dirty = 0;
+    qsort(dirs, n, sizeof(*dirs), compar_dirty_dir);
+
+    int ret = 0;
+    for (size_t i = 0; i < n && ret == 0; i++)
+    {
+        size_t pos;
+        if (find_watched_dir(w, dirs[i].wd, &pos) && w->dirs[pos]->dirty)
+            ret = rescan_watched_dir(w, w->dirs[pos], added, removed);
+    }
+    free(dirs);
+
+    return ret;
+}
+
+struct fl_watch *file_list_watch_create(int file_type,
+    const char *regex_pattern, int dirfd, const char *dir, int depth,
+    int flags, enum FL_SORT_METHOD sort_method,
+    const struct fl_options *options)
+{
+    // With FL_FOLLOW_LINKS, a directory could be watched at several paths.
+    if (flags & (FL_BREADTH_FIRST | FL_FOLLOW_LINKS | FL_IGNORE_FILES
+        | FL_UNIQUE_INODES | FL_UNIQUE_DIRS))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct fl_watch *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+    w->base_fd = AT_FDCWD;
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->fd == -1)
+    {
+        free(w);
+        return NULL;
+    }
+    if (dirfd != AT_FDCWD
+        && (w->base_fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0)) == -1)
+    {
+        file_list_watch_destroy(w);
+        return NULL;
+    }
+
+    set_file_type_arr(w->file_type_arr, file_type);
+    if (regex_pattern)
+    {
+        if (regcomp(&w->regex, regex_pattern, get_regex_flags(flags)))
+        {
+            file_list_watch_destroy(w);
+            return NULL;
+        }
+        w->has_regex = true;
+    }
+    if (options && options->exclude_dirs)
+    {
+        if (regcomp(&w->exclude, options->exclude_dirs,
+            get_regex_flags(flags)))
+        {
+            file_list_watch_destroy(w);
+            return NULL;
+        }
+        w->has_exclude = true;
+    }
+    w->flags = flags;
+    w->compar_fn = get_compar_fn(sort_method);
+    w->max_open = get_max_open_dirs(options);
+
+    w->start_dir = create_clean_dir(dir);
+    w->list = malloc(sizeof(char *));
+    if (w->start_dir == NULL || w->list == NULL)
+    {
+        file_list_watch_destroy(w);
+        return NULL;
+    }
+    w->list[0] = NULL;
+
+    // If the start directory is not accessible, the file list stays empty.
+    struct stat sb;
+    int dir_fd = open_start_dir(w->base_fd, w->start_dir, &sb);
+    if (dir_fd == -1)
+    {
+        if (errno == EACCES)
+            return w;
+        file_list_watch_destroy(w);
+        return NULL;
+    }
+    w->root_dev = sb.st_dev;
+
+    struct path_array added = { 0 };
+    struct path_array removed = { 0 };
+    int ret = scan_watched_dir(w, dir_fd, &sb, w->start_dir, depth, &added,
+        &removed);
+    if (ret == 0)
+        ret = apply_watch_changes(w, &added, &removed, NULL, NULL);
+    if (ret)
+    {
+        int saved_errno = errno;
+        for (size_t i = 0; i < added.n; i++)
+            free(added.paths[i]);
+        file_list_watch_destroy(w);
+        w = NULL;
+        errno = saved_errno;
+    }
+    free(added.paths);
+    free(removed.paths);
+
+    return w;
+}
+
+int file_list_watch_fd(const struct fl_watch *watch)
+{
+    return watch->fd;
+}
+
+const char *const *file_list_watch_list(const struct fl_watch *watch,
+    size_t *n)
+{
+    if (n)
+        *n = watch->n;
+
+    return (const char *const *) watch->list;
+}
+
+ssize_t file_list_watch_update(struct fl_watch *watch, char ***added,
+    char ***removed)
+{
+    struct path_array a = { 0 };
+    struct path_array r = { 0 };
+    int ret = read_watch_events(watch);
+    if (ret == 0)
+        ret = rescan_dirty_dirs(watch, &a, &r);
+    if (ret == 0)
+        ret = apply_watch_changes(watch, &a, &r, added, removed);
+    compact_watched_dirs(watch);
+
+    // After an error, the changes that have been found are lost, so the whole
+    // directory tree is read again next time.
+    ssize_t n = a.n + r.n;
+    if (ret)
+    {
+        int saved_errno = errno;
+        for (size_t i = 0; i < a.n; i++)
+            free(a.paths[i]);
+        mark_all_watched_dirs(watch);
+        errno = saved_errno;
+        n = -1;
+    }
+    free(a.paths);
+    free(r.paths);
+
+    return n;
+}
+
+void file_list_watch_destroy(struct fl_watch *watch)
+{
+    if (watch == NULL)
+        return;
+
+    int saved_errno = errno;
+    for (size_t i = 0; i < watch->n_dirs; i++)
+        free_watched_dir(watch->dirs[i]);
+    free(watch->dirs);
+    free(watch->dirty);
+    free(watch->visited);
+    for (size_t i = 0; i < watch->kept.n; i++)
+        free(watch->kept.paths[i]);
+    free(watch->kept.paths);
+    for (size_t i = 0; i < watch->n; i++)
+        free(watch->index[i]);
+    free(watch->index);
+    free(watch->list);
+    if (watch->has_regex)
+        regfree(&watch->regex);
+    if (watch->has_exclude)
+        regfree(&watch->exclude);
+    free(watch->start_dir);
+    if (watch->base_fd >= 0)
+        close(watch->base_fd);
+    close(watch->fd);
+    free(watch);
+    errno = saved_errno;
+}
+
+#else
+
+struct fl_watch *file_list_watch_create(int file_type,
+    const char *regex_pattern, int dirfd, const char *dir, int depth,
+    int flags, enum FL_SORT_METHOD sort_method,
+    const struct fl_options *options)
+{
+    (void) file_type;
+    (void) regex_pattern;
+    (void) dirfd;
+    (void) dir;
+    (void) depth;
+    (void) flags;
+    (void) sort_method;
+    (void) options;
+    errno = ENOSYS;
+    return NULL;
+}
+
+int file_list_watch_fd(const struct fl_watch *watch)
+{
+    (void) watch;
+    return -1;
+}
+
+const char *const *file_list_watch_list(const struct fl_watch *watch,
+    size_t *n)
+{
+    (void) watch;
+    (void) n;
+    return NULL;
+}
+
+ssize_t file_list_watch_update(struct fl_watch *watch, char ***added,
+    char ***removed)
+{
+    (void) watch;
+    (void) added;
+    (void) removed;
+    errno = ENOSYS;
+    return -1;
+}
 
-                if (parse_file_tree(file_list, n_file_list,
-                    n_file_list_max, file_type_arr, file_ext, current_path,
-                    directory_depth > 0 ? directory_depth - 1 : directory_depth,
-                    stack, flags))
-                {
-                    free(current_path);
-                    closedir(dir);
-                    return -1;
-                }
+void file_list_watch_destroy(struct fl_watch *watch)
+{
+    (void) watch;
+}
 
-                stat_stack_pop(stack);
-            }
-        }
+#endif
 
-        // Add file name to file list.
-        if (file_type_arr[current_type] == 1)
-        {
-            // Ignore file if the regular expression doesn't match.
-            if (file_ext && !matches_regex(dp->d_name, file_ext))
-            {
-                if (current_path)
-                    free(current_path);
-                continue;
-            }
+// Frees a file list along with its paths' arena. Paths that are not allocated
+// in the arena, i.e. those that the caller has put into the list, are freed one
+// by one.
+void file_list_destroy(char ***file_list)
+{
+    if (*file_list == NULL)
+        return;
 
-            CREATE_CURRENT_PATH();
+    struct list_header *h = get_list_header(*file_list);
+    struct path_arena arena = { h->chunks };
+    free_foreign_paths(*file_list, &arena);
+    arena_free(&arena);
+    free(h);
+    *file_list = NULL;
+}
 
-            // If requested, add a trailing directory separator.
-            if (current_type == 4 && flags & FL_DIR_SEP)
-            {
-                size_t new_len = strlen(current_path) + 1;
-                char *new_path = realloc(current_path, new_len + 1);
-                if (new_path == NULL)
-                {
-                    free(current_path);
-                    closedir(dir);
-                    return -1;
-                }
+void file_list_metadata_free(struct fl_metadata *metadata)
+{
+    meta_free(metadata);
+}
 
-                new_path[new_len - 1] = DIR_SEPARATOR;
-                new_path[new_len] = '\0';
-                current_path = new_path;
-            }
+// Helper function for file_list_merge(); returns a file list's size.
+static size_t file_list_getsize(const char **file_list)
+{
+    size_t n = 0;
+    while (*file_list++ != NULL)
+        n++;
 
-            if (file_list_add(file_list, n_file_list, n_file_list_max,
-                current_path) == -1)
-            {
-                free(current_path);
-                closedir(dir);
-                return -1;
-            }
-        }
-        else if (current_path)
-            free(current_path);
+    return n;
+}
+
+// Merges two file lists by appending the files of <source> to <destination>
+// and optionally sorting it. The destination takes over the source's paths,
+// along with the memory blocks they are allocated in, the source's array is
+// freed, and <*source> is set to NULL.
+// Specifying the lists' sizes is faster but optional (0 meaning unspecified).
+// On error, -1 is returned, errno is set to indicate the error, and the
+// destination list remains unchanged.
+ssize_t file_list_merge(char ***destination, size_t n_dest,
+    const char ***source, size_t n_source, enum FL_SORT_METHOD sort_method)
+{
+    if (n_dest == 0)
+        n_dest = file_list_getsize((const char **) *destination);
+    if (n_source == 0)
+        n_source = file_list_getsize(*source);
+
+    size_t n = n_dest + n_source;
+    // Overflow check.
+    if (n < n_source
+        || n + 1 > (SIZE_MAX - sizeof(struct list_header)) / sizeof(char *))
+    {
+        errno = ERANGE;
+        return -1;
     }
 
-    closedir(dir);
-    return 0;
+    struct list_header *h = realloc(get_list_header(*destination),
+        sizeof(*h) + (n + 1) * sizeof(char *));
+    if (h == NULL)
+        return -1;
+    *destination = (char **) (void *) (h + 1);
+    memcpy(*destination + n_dest, *source, n_source * sizeof(char *));
+    (*destination)[n] = NULL;
 
-#undef CREATE_CURRENT_PATH
+    // The destination takes over the source's arena, and the source's array
+    // is freed.
+    struct list_header *source_h = get_list_header((char *const *) *source);
+    struct path_arena arena = { h->chunks };
+    struct path_arena source_arena = { source_h->chunks };
+    arena_adopt(&arena, &source_arena);
+    h->chunks = arena.chunks;
+    free(source_h);
+    *source = NULL;
+
+    // Sort concatenated file list.
+    int (*compar_fn)(const void *, const void *) = get_compar_fn(sort_method);
+    if (compar_fn)
+        qsort(*destination, n, sizeof(char *), compar_fn);
+
+    return n;
 }
 
-// Public functions ------------------------------------------------------------
+// The format version of snapshot files. Files of other versions are rejected.
+#define FL_SNAPSHOT_VERSION 1
 
-ssize_t file_list_create(char ***file_list, int file_type,
-    const char *regex_pattern, const char *dir, int depth, int flags,
-    enum FL_SORT_METHOD sort_method)
+// A snapshot file starts with this header, followed by an array of <n> 64-bit
+// offsets and a blob of NUL-terminated strings, which the offsets point into.
+// The blob starts with the root directory's string, if there is one. All
+// numbers are in the byte order of the machine that has written the file.
+struct snapshot_header
 {
-    // Allocate initial memory for file list.
-    *file_list = malloc(FL_INITIAL_LIST_SIZE * sizeof(char *));
-    if (*file_list == NULL)
+    char magic[8];               // "FLSNAP" and 2 NUL bytes.
+    uint32_t version;
+    uint32_t byte_order;         // 0x01020304, to detect foreign byte orders.
+    uint32_t sort_method;
+    uint32_t reserved;
+    uint64_t n;                  // The number of files.
+    uint64_t root;               // The root's offset + 1, or 0 if there is no
+                                 // root.
+    uint64_t blob_size;
+    int64_t time;
+};
+
+// A snapshot file that has been mapped into memory.
+struct snapshot_mapping
+{
+    struct fl_snapshot snapshot;
+    void *map;
+    size_t size;
+};
+
+// Writes a snapshot file's contents to <stream>.
+// On error, -1 is returned and errno is set.
+static int write_snapshot(FILE *stream, char *const *file_list,
+    size_t n, const char *root, enum FL_SORT_METHOD sort_method)
+{
+    struct snapshot_header header = {
+        .magic = "FLSNAP",
+        .version = FL_SNAPSHOT_VERSION,
+        .byte_order = 0x01020304,
+        .sort_method = sort_method,
+        .n = n,
+        .root = root ? 1 : 0,
+        .time = time(NULL),
+    };
+    uint64_t offset = root ? strlen(root) + 1 : 0;
+    for (size_t i = 0; i < n; i++)
+        offset += strlen(file_list[i]) + 1;
+    header.blob_size = offset;
+    if (fwrite(&header, sizeof(header), 1, stream) != 1)
         return -1;
-    size_t file_list_size = 0;
-    size_t file_list_size_max = FL_INITIAL_LIST_SIZE;
 
-    // Create file type lookup array (its indexes are DT_ values from dirent.h).
-    int file_type_arr[13] = { 0 };
-    if (file_type == 0)
+    offset = root ? strlen(root) + 1 : 0;
+    for (size_t i = 0; i < n; i++)
     {
-        for (int i = 0; i < 13; i++)
-            file_type_arr[i] = 1;
+        if (fwrite(&offset, sizeof(offset), 1, stream) != 1)
+            return -1;
+        offset += strlen(file_list[i]) + 1;
     }
-    else
+
+    if (root && fwrite(root, strlen(root) + 1, 1, stream) != 1)
+        return -1;
+    for (size_t i = 0; i < n; i++)
     {
-        if (file_type & FL_UNKNOWN)
-            file_type_arr[0] = 1;
-        if (file_type & FL_FIFO)
-            file_type_arr[1] = 1;
-        if (file_type & FL_CHR)
-            file_type_arr[2] = 1;
-        if (file_type & FL_DIR)
-            file_type_arr[4] = 1;
-        if (file_type & FL_BLK)
-            file_type_arr[6] = 1;
-        if (file_type & FL_REG)
-            file_type_arr[8] = 1;
-        if (file_type & FL_LNK)
-            file_type_arr[10] = 1;
-        if (file_type & FL_SOCK)
-            file_type_arr[12] = 1;
-    }
-
-    // Compile regular expression.
-    regex_t regex;
-    if (regex_pattern)
+        if (fwrite(file_list[i], strlen(file_list[i]) + 1, 1, stream) != 1)
+            return -1;
+    }
+
+    return 0;
+}
+
+// The number of random names that file_list_save() tries for its temporary
+// file. Can be changed arbitrarily.
+#define TEMP_FILE_ATTEMPTS 100
+
+// Creates a new file whose path is the first <len> characters of <path>,
+// followed by a dot and 6 random characters, and saves the path in <path>.
+// Unlike mkstemp(), it applies the umask to the file's mode (0666).
+// Returns the file's descriptor, or -1 on error, with errno set (EEXIST if no
+// unused name has been found).
+static int create_temp_file(char *path, size_t len)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    static unsigned counter;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t x = (uint64_t) ts.tv_sec << 32 ^ (uint64_t) ts.tv_nsec
+        ^ (uint64_t) getpid() << 16
+        ^ __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+
+    for (int attempt = 0; attempt < TEMP_FILE_ATTEMPTS; attempt++)
     {
-        int regex_flags = REG_NOSUB;
-        if (flags)
+        path[len] = '.';
+        for (size_t i = 1; i <= 6; i++)
         {
-            if (!(flags & FL_REGEX_BASIC))
-                regex_flags |= REG_EXTENDED;
-            if (!(flags & FL_REGEX_CASE))
-                regex_flags |= REG_ICASE;
+            x = x * 6364136223846793005u + 1442695040888963407u;
+            path[len + i] = chars[(x >> 33) % (sizeof(chars) - 1)];
         }
+        path[len + 7] = '\0';
 
-        if (regcomp(&regex, regex_pattern, regex_flags))
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd != -1 || errno != EEXIST)
+            return fd;
+    }
+
+    return -1;
+}
+
+int file_list_save(char *const *file_list, size_t n, const char *root,
+    enum FL_SORT_METHOD sort_method, const char *path)
+{
+    if (n == 0)
+        n = file_list_getsize((const char **) file_list);
+
+    // The snapshot is written to a temporary file first, which then replaces
+    // <path>, so that snapshots that are in use stay intact.
+    size_t len = strlen(path);
+    char *tmp_path = malloc(len + 8);
+    if (tmp_path == NULL)
+        return -1;
+    memcpy(tmp_path, path, len);
+    int fd = create_temp_file(tmp_path, len);
+    if (fd == -1)
+    {
+        free(tmp_path);
+        return -1;
+    }
+
+    // The file is synced before it replaces <path>, so that a crash can't leave
+    // an empty or partial snapshot behind.
+    int ret = -1;
+    FILE *stream = fdopen(fd, "wb");
+    if (stream == NULL)
+        close(fd);
+    else
+    {
+        if (write_snapshot(stream, file_list, n, root, sort_method) == 0
+            && fflush(stream) == 0 && fsync(fd) == 0)
         {
-            free(*file_list);
-            return -1;
+            ret = 0;
         }
+        int saved_errno = errno;
+        if (fclose(stream))
+            ret = -1;
+        else
+            errno = saved_errno;
     }
+    if (ret == 0)
+        ret = rename(tmp_path, path);
 
-    // Strip superfluous directory separators.
-    char *start_dir = create_clean_dir(dir);
-    if (start_dir == NULL)
+    int saved_errno = errno;
+    if (ret)
+        unlink(tmp_path);
+    free(tmp_path);
+    errno = saved_errno;
+
+    return ret;
+}
+
+// Checks a mapped snapshot file's header and creates the file list's pointers.
+// On error, -1 is returned and errno is set.
+static int load_snapshot(struct snapshot_mapping *m)
+{
+    struct snapshot_header header;
+    if (m->size < sizeof(header))
     {
-        free(*file_list);
-        if (regex_pattern)
-            regfree(&regex);
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(&header, m->map, sizeof(header));
+    if (memcmp(header.magic, "FLSNAP\0", 8)
+        || header.version != FL_SNAPSHOT_VERSION
+        || header.byte_order != 0x01020304)
+    {
+        errno = EINVAL;
         return -1;
     }
 
-    // Set up initial stat stack, which is used for loop detection.
-    struct stat_stack stack;
-    if (stat_stack_create(&stack))
+    // Check the sizes before trusting any offset.
+    size_t max_n = (m->size - sizeof(header)) / sizeof(uint64_t);
+    if (header.n > max_n || header.n > FL_MAX_LIST_SIZE
+        || header.blob_size != m->size - sizeof(header)
+        - header.n * sizeof(uint64_t))
     {
-        free(*file_list);
-        if(regex_pattern)
-            regfree(&regex);
-        free(start_dir);
+        errno = EINVAL;
         return -1;
     }
-    struct stat sb;
-    if (stat(dir, &sb))
+    const char *blob = (const char *) m->map + sizeof(header)
+        + header.n * sizeof(uint64_t);
+    size_t blob_size = header.blob_size;
+    if (blob_size && blob[blob_size - 1] != '\0')
     {
-        free(*file_list);
-        if (regex_pattern)
-            regfree(&regex);
-        free(start_dir);
-        stat_stack_destroy(&stack);
+        errno = EINVAL;
         return -1;
     }
-    stat_stack_push(&stack, &sb);
 
-    // Populate file list.
-    int ret = parse_file_tree(file_list, &file_list_size, &file_list_size_max,
-        file_type_arr, regex_pattern ? &regex : NULL, start_dir, depth, &stack,
-        flags);
-    if (regex_pattern)
-        regfree(&regex);
-    free(start_dir);
-    stat_stack_destroy(&stack);
-    if (ret && errno != E2BIG)
-    {
-        for (size_t i = 0; i < file_list_size; i++)
-            free((*file_list)[i]);
-        free(*file_list);
-        *file_list = NULL;
+    size_t n = header.n;
+    const char **file_list = malloc((n + 1) * sizeof(char *));
+    if (file_list == NULL)
         return -1;
+    const uint64_t *offsets = (const uint64_t *) ((const char *) m->map
+        + sizeof(header));
+    for (size_t i = 0; i < n; i++)
+    {
+        if (offsets[i] >= blob_size)
+        {
+            free(file_list);
+            errno = EINVAL;
+            return -1;
+        }
+        file_list[i] = blob + offsets[i];
     }
+    file_list[n] = NULL;
 
-    // Trim file list and make it NULL-terminated.
-    char **p = realloc(*file_list, (file_list_size + 1) * sizeof(char *));
-    if (p == NULL)
+    if (header.root && header.root > blob_size)
+    {
+        free(file_list);
+        errno = EINVAL;
         return -1;
-    *file_list = p;
-    (*file_list)[file_list_size] = NULL;
+    }
+    m->snapshot.file_list = file_list;
+    m->snapshot.n = n;
+    m->snapshot.root = header.root ? blob + header.root - 1 : NULL;
+    m->snapshot.sort_method = header.sort_method;
+    m->snapshot.time = header.time;
 
-    // Sort file list.
-    int (*compar_fn)(const void *, const void *) = get_compar_fn(sort_method);
-    if (compar_fn)
-        qsort(*file_list, file_list_size, sizeof(char *), compar_fn);
+    return 0;
+}
 
-    return file_list_size;
+struct fl_snapshot *file_list_open_snapshot(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat sb;
+    if (fstat(fd, &sb))
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (sb.st_size < (off_t) sizeof(struct snapshot_header))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct snapshot_mapping *m = malloc(sizeof(*m));
+    if (m == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    m->size = sb.st_size;
+    m->map = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (m->map == MAP_FAILED)
+    {
+        free(m);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (load_snapshot(m))
+    {
+        saved_errno = errno;
+        munmap(m->map, m->size);
+        free(m);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return &m->snapshot;
 }
 
-// Frees memory space previously allocated by file_list_create().
-void file_list_destroy(char ***file_list)
+void file_list_close_snapshot(struct fl_snapshot *snapshot)
 {
-    if (*file_list == NULL)
+    if (snapshot == NULL)
         return;
 
-    for (size_t i = 0; (*file_list)[i] != NULL; i++)
-        free((*file_list)[i]);
-    free(*file_list);
-    *file_list = NULL;
+    struct snapshot_mapping *m = (struct snapshot_mapping *) snapshot;
+    free((void *) snapshot->file_list);
+    munmap(m->map, m->size);
+    free(m);
 }
 
-// Helper function for file_list_merge(); returns a file list's size.
-static size_t file_list_getsize(const char **file_list)
+// A path that is copied before being compared by a callback function for
+// qsort(), which temporarily modifies the strings it compares, so that file
+// lists in read-only memory (like snapshots) can be compared as well.
+struct path_copy
 {
-    size_t n = 0;
-    while (*file_list++ != NULL)
-        n++;
+    char *path;
+    size_t size;
+};
 
-    return n;
+// Copies <path> into <copy>, reusing its memory space.
+// On error, -1 is returned and errno is set.
+static int copy_path(struct path_copy *copy, const char *path)
+{
+    size_t len = strlen(path) + 1;
+    if (len > copy->size)
+    {
+        char *p = realloc(copy->path, len);
+        if (p == NULL)
+            return -1;
+        copy->path = p;
+        copy->size = len;
+    }
+    memcpy(copy->path, path, len);
+
+    return 0;
 }
 
-// Merges two file lists by appending a copy of <source> to <destination> and
-// optionally sorting it.
-// Specifying the lists' sizes is faster but optional (0 meaning unspecified).
-// On error, -1 is returned, errno is set to indicate the error, and the
-// destination list remains unchanged.
-ssize_t file_list_merge(char ***destination, size_t n_dest,
-    const char ***source, size_t n_source, enum FL_SORT_METHOD sort_method)
+// Adds a copy of <path>, allocated in <arena>, to a path array, unless <array>
+// is NULL.
+// On error, -1 is returned and errno is set.
+static int add_diff_path(struct path_array *array, struct path_arena *arena,
+    const char *path)
 {
-    if (n_dest == 0)
-        n_dest = file_list_getsize((const char **) *destination);
-    if (n_source == 0)
-        n_source = file_list_getsize(*source);
+    if (array == NULL)
+        return 0;
 
-    size_t n = n_dest + n_source;
-    if (n < n_source || n + 1 == 0) // Overflow check.
+    char *copy = arena_strdup(arena, path);
+    if (copy == NULL)
+        return -1;
+
+    return path_array_add(array, copy);
+}
+
+// Terminates a path array that has been filled by add_diff_path(), making it a
+// file list.
+// On error, -1 is returned and errno is set.
+static int finish_diff_paths(struct path_array *array,
+    struct path_arena *arena)
+{
+    char **list = finish_file_list(array->paths, array->n, arena);
+    if (list == NULL)
+        return -1;
+    array->paths = list;
+
+    return 0;
+}
+
+// Returns 1 if the metadata <fields> of file <i> of <a> and file <j> of <b>
+// differ, otherwise 0.
+static int meta_differs(const struct fl_metadata *a, size_t i,
+    const struct fl_metadata *b, size_t j, int fields)
+{
+    return (fields & FL_META_SIZE && a->size[i] != b->size[j])
+        || (fields & FL_META_MTIME
+        && !timespec_equal(&a->mtime[i], &b->mtime[j]))
+        || (fields & FL_META_MODE && a->mode[i] != b->mode[j])
+        || (fields & FL_META_INO && a->ino[i] != b->ino[j])
+        || (fields & FL_META_DEV && a->dev[i] != b->dev[j])
+        || (fields & FL_META_NLINK && a->nlink[i] != b->nlink[j]);
+}
+
+ssize_t file_list_diff(const char *const *old_list, size_t n_old,
+    const struct fl_metadata *old_meta, const char *const *new_list,
+    size_t n_new, const struct fl_metadata *new_meta,
+    enum FL_SORT_METHOD sort_method, char ***added, char ***removed,
+    char ***modified)
+{
+    int (*compar_fn)(const void *, const void *) = get_compar_fn(sort_method);
+    if (compar_fn == NULL)
     {
-        errno = ERANGE;
+        errno = EINVAL;
         return -1;
     }
+    if (n_old == 0)
+        n_old = file_list_getsize((const char **) old_list);
+    if (n_new == 0)
+        n_new = file_list_getsize((const char **) new_list);
 
-    char **p = realloc(*destination, (n + 1) * sizeof(char *));
-    if (p == NULL)
+    // Only the fields that have been captured for both lists are compared.
+    int fields = old_meta && new_meta ? old_meta->fields & new_meta->fields
+        : 0;
+
+    // Both lists are in the same order, so a single pass finds all paths that
+    // are in only one of them, and all paths in both whose metadata differs.
+    struct path_array added_paths = { 0 };
+    struct path_array removed_paths = { 0 };
+    struct path_array modified_paths = { 0 };
+    struct path_arena added_arena = { 0 };
+    struct path_arena removed_arena = { 0 };
+    struct path_arena modified_arena = { 0 };
+    struct path_array *added_array = added ? &added_paths : NULL;
+    struct path_array *removed_array = removed ? &removed_paths : NULL;
+    struct path_array *modified_array = modified ? &modified_paths : NULL;
+    struct path_copy old_copy = { 0 };
+    struct path_copy new_copy = { 0 };
+    size_t i = 0;
+    size_t j = 0;
+    ssize_t n = 0;
+    bool ok = true;
+    while (ok && (i < n_old || j < n_new))
+    {
+        int result;
+        if (i == n_old)
+            result = 1;
+        else if (j == n_new)
+            result = -1;
+        else if ((result = strcmp(old_list[i], new_list[j])) != 0)
+        {
+            // Most paths are in both lists, so only differing ones are copied.
+            if (copy_path(&old_copy, old_list[i])
+                || copy_path(&new_copy, new_list[j]))
+            {
+                ok = false;
+                break;
+            }
+
+            // Paths that differ but are equal in sort order keep the order of
+            // strcmp().
+            int r = compar_fn(&old_copy.path, &new_copy.path);
+            if (r)
+                result = r;
+        }
+
+        if (result < 0)
+        {
+            ok = add_diff_path(removed_array, &removed_arena,
+                old_list[i++]) == 0;
+        }
+        else if (result > 0)
+            ok = add_diff_path(added_array, &added_arena, new_list[j++]) == 0;
+        else if (fields && meta_differs(old_meta, i, new_meta, j, fields))
+        {
+            i++;
+            ok = add_diff_path(modified_array, &modified_arena,
+                new_list[j++]) == 0;
+        }
+        else
+        {
+            i++;
+            j++;
+            continue;
+        }
+        n++;
+    }
+    free(old_copy.path);
+    free(new_copy.path);
+
+    bool added_done = false;
+    bool removed_done = false;
+    if (ok && added)
+        ok = added_done = finish_diff_paths(&added_paths, &added_arena) == 0;
+    if (ok && removed)
+        ok = removed_done = finish_diff_paths(&removed_paths,
+            &removed_arena) == 0;
+    if (ok && modified)
+        ok = finish_diff_paths(&modified_paths, &modified_arena) == 0;
+    if (!ok)
+    {
+        int saved_errno = errno;
+        // Finished lists own their arenas.
+        if (added_done)
+            file_list_destroy(&added_paths.paths);
+        if (removed_done)
+            file_list_destroy(&removed_paths.paths);
+        free(added_paths.paths);
+        free(removed_paths.paths);
+        free(modified_paths.paths);
+        arena_free(&added_arena);
+        arena_free(&removed_arena);
+        arena_free(&modified_arena);
+        errno = saved_errno;
         return -1;
-    *destination = p;
-    memcpy(*destination + n_dest, *source, n_source * sizeof(char *));
-    (*destination)[n] = NULL;
-    *source = NULL;
+    }
 
-    // Sort concatenated file list.
-    int (*compar_fn)(const void *, const void *) = get_compar_fn(sort_method);
-    if (compar_fn)
-        qsort(*destination, n, sizeof(char *), qsort_compar_default);
+    if (added)
+        *added = added_paths.paths;
+    if (removed)
+        *removed = removed_paths.paths;
+    if (modified)
+        *modified = modified_paths.paths;
 
     return n;
 }
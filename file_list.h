@@ -7,6 +7,7 @@
 #include <regex.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 // File types for file_list_create().
 #define FL_UNKNOWN   1
@@ -19,11 +20,19 @@
 #define FL_SOCK    128
 
 // Flags for file_list_create().
-#define FL_FOLLOW_LINKS  1
-#define FL_DIR_SEP       2
-#define FL_REGEX_CASE    4
-#define FL_REGEX_BASIC   8
-#define FL_XDEV         16
+#define FL_FOLLOW_LINKS       1
+#define FL_DIR_SEP            2
+#define FL_REGEX_CASE         4
+#define FL_REGEX_BASIC        8
+#define FL_XDEV              16
+#define FL_ASYNC_STAT        32
+#define FL_STATX_DONT_SYNC   64
+#define FL_BREADTH_FIRST    128
+#define FL_STAT             256
+#define FL_IGNORE_FILES     512
+#define FL_UNIQUE_INODES   1024
+#define FL_UNIQUE_DIRS     2048
+#define FL_INODE_ORDER     4096
 
 // Sort methods for file_list_create().
 enum FL_SORT_METHOD
@@ -35,6 +44,160 @@ enum FL_SORT_METHOD
     FL_SORT_ASCII,
 };
 
+// Reasons why a traversal has ended, for struct fl_options's member .status.
+// All but FL_STATUS_COMPLETE mean that the file list may be incomplete.
+enum FL_STATUS
+{
+    FL_STATUS_COMPLETE,
+    FL_STATUS_MAX_MATCHES,
+    FL_STATUS_MAX_ENTRIES,
+    FL_STATUS_TIMEOUT,
+    FL_STATUS_CANCELED,
+};
+
+// A cache of directory entries for repeated traversals of the same directory
+// tree, created by file_list_cache_create().
+struct fl_cache;
+
+// Metadata fields for struct fl_metadata's member .fields.
+#define FL_META_SIZE     1
+#define FL_META_MTIME    2
+#define FL_META_MODE     4
+#define FL_META_INO      8
+#define FL_META_DEV     16
+#define FL_META_NLINK   32
+
+// The metadata of a file list's files, captured by file_list_create_ex() (see
+// struct fl_options's member .metadata). Each selected field is an array that
+// is indexed like the file list; the arrays of other fields are NULL and take
+// no memory space. Must be freed with file_list_metadata_free().
+struct fl_metadata
+{
+    // The fields to capture, as FL_META_ values combined via bitwise OR. Set by
+    // the caller.
+    int fields;
+
+    off_t *size;
+    struct timespec *mtime;
+    mode_t *mode;
+    ino_t *ino;
+    dev_t *dev;
+    nlink_t *nlink;
+};
+
+// Counters and timings of a traversal, filled in by file_list_create_ex() (see
+// struct fl_options's member .stats). Counts of system calls include those made
+// by all threads of a parallel traversal.
+struct fl_stats
+{
+    size_t entries;        // Directory entries examined.
+    size_t dirs_opened;    // Directories opened, including reopened ones.
+    size_t dir_reads;      // Calls of getdents64() (Linux), else readdir().
+    size_t stat_calls;     // Stat requests, including asynchronous ones.
+    size_t stat_failures;  // Stat requests that have failed.
+    size_t loops_skipped;  // Directories not entered because of loops (or,
+                           // with FL_UNIQUE_DIRS, because entered before).
+    size_t xdev_skipped;   // Directories on other file systems (FL_XDEV).
+    size_t regex_evals;    // Matches of <regex> and .exclude_dirs attempted.
+    size_t regex_matches;  // Attempted matches that have succeeded.
+    size_t list_reallocs;  // Reallocations of the file list's array.
+
+    // Wall time in seconds spent traversing the directory tree, trimming the
+    // file list, and sorting it.
+    double traverse_time;
+    double trim_time;
+    double sort_time;
+};
+
+// Optional settings for file_list_create_ex(). Members that are 0 select the
+// default behavior, so a zero-initialized structure is equivalent to passing
+// NULL.
+struct fl_options
+{
+    // The number of threads that traverse the directory tree in parallel;
+    // 0 and 1 mean "no parallel traversal" and -1 means "one thread per online
+    // processor". The sorted file list is the same as with a single thread.
+    int threads;
+
+    // The maximum number of directories that serial traversal keeps open at the
+    // same time (minimum 2; 0 means 64). If more would be needed, directories
+    // are read into memory and closed early, so deep trees neither exhaust the
+    // process's file descriptors nor fail with EMFILE. The same happens if the
+    // process runs out of file descriptors before the limit is reached.
+    int max_open_dirs;
+
+    // The number of directories that a helper thread reads ahead of serial
+    // depth-first traversal, so that they are in the kernel's caches by the
+    // time they are needed; 0 means "no prefetching". Can speed up cold-cache
+    // scans of slow storage (e.g. rotating disks or network file systems) if
+    // a processor is idle; otherwise, it only adds work. The helper keeps up
+    // to .max_open_dirs more directories open, and its system calls are not
+    // counted in .stats. The helper only reads directories: it doesn't stat
+    // files for FL_STAT or read ignore files, and subtrees that are ignored or
+    // that file_list_walk() skips are left by the helper as well. Ignored with
+    // FL_BREADTH_FIRST, parallel traversal, .cache, and FL_NO_THREADS.
+    int prefetch_dirs;
+
+    // Stops the traversal as soon as the file list holds this many files;
+    // 0 means "no limit". With FL_BREADTH_FIRST, these are the matches closest
+    // to the start directory. Parallel traversal is not used if this is not 0.
+    size_t max_matches;
+
+    // A regular expression (of the same kind as <regex>) that is matched
+    // against directory names. Matching directories are neither added to the
+    // file list nor opened, so their subtrees are skipped entirely, e.g.
+    // "^(\\.git|node_modules)$". NULL means "no exclusions".
+    const char *exclude_dirs;
+
+    // A cache that keeps each directory's entries, along with its modification
+    // and status change times. Subsequent traversals do not read directories
+    // that have not been modified since, but take their entries from the cache.
+    // Directories that have not been found again are removed from the cache
+    // after each complete traversal, so each start directory should have a
+    // cache of its own. A cache must not be used by multiple traversals at the
+    // same time. Parallel traversal is not used if this is not NULL, and the
+    // cache is ignored with FL_BREADTH_FIRST. NULL means "no cache".
+    struct fl_cache *cache;
+
+    // Stops the traversal once this many milliseconds have passed since the
+    // function has been called (or, for iterators, since they have been
+    // opened); 0 means "no limit". The clock is checked every few directory
+    // entries, so the deadline is met as long as single system calls are
+    // fast.
+    long timeout;
+
+    // Stops the traversal once this many directory entries have been
+    // examined, whether they match or not; 0 means "no limit". Unlike
+    // .max_matches, this bounds the work done for sparse matches, and parallel
+    // traversal is still used.
+    size_t max_entries;
+
+    // If not NULL, the traversal stops as soon as possible once the int it
+    // points to is not 0. It may be set by another thread at any time, e.g.
+    // via C11's atomic_store() or GCC's __atomic_store_n().
+    const int *cancel;
+
+    // If not NULL, receives why the traversal has ended (see enum FL_STATUS).
+    // If a limit has been reached, the function succeeds with the files found
+    // so far, and only this value tells that the file list is partial.
+    // file_list_create_ex() sets it on success, file_list_iter_next() and
+    // file_list_walk() once there are no more files.
+    enum FL_STATUS *status;
+
+    // If not NULL, receives counters and timings of the traversal, to tell
+    // file system latency apart from sorting costs. Iterators update the
+    // counters while they go; their times stay 0.
+    struct fl_stats *stats;
+
+    // If not NULL and its member .fields is not 0, receives the selected
+    // metadata of each file, so that files do not need to be stat'ed again.
+    // Only matching files are stat'ed for it, requesting only the selected
+    // fields where possible. Metadata that could not be retrieved is 0. On
+    // error, the metadata's arrays are NULL. Used by file_list_create_ex()
+    // only.
+    struct fl_metadata *metadata;
+};
+
 // Enables debug output.
 #define FL_DEBUG
 
@@ -43,9 +206,29 @@ enum FL_SORT_METHOD
 // compile.
 //#define FL_NO_D_TYPE
 
+// On Linux, directories are read by calling getdents64 directly with a large
+// buffer. Define FL_NO_GETDENTS to use the portable readdir() instead.
+//#define FL_NO_GETDENTS
+
+// Disables support for FL_ASYNC_STAT, e.g. for systems that lack the header
+// <linux/io_uring.h>.
+//#define FL_NO_IO_URING
+
+// Disables parallel traversal, removing the dependency on POSIX threads.
+//#define FL_NO_THREADS
+
+// Disables support for file_list_watch_create(), e.g. for systems that lack the
+// header <sys/inotify.h>.
+//#define FL_NO_INOTIFY
+
 // Creates a sorted list of files (char **) that are found inside a specified
 // directory. The list is saved in dynamically allocated memory and ends with a
-// terminating NULL pointer.
+// terminating NULL pointer. Its paths are allocated in large blocks that belong
+// to the list, so they must not be freed or reallocated individually. The array
+// is allocated along with a hidden header in front of it, so it must not be
+// passed to free() or realloc() either; the list must be freed with
+// file_list_destroy(). Paths may be replaced with strings allocated by
+// malloc(), and the list may be truncated by setting an element to NULL.
 //
 // Parameters:
 // file_list       A pointer used to allocate and save the file list.
@@ -77,6 +260,36 @@ enum FL_SORT_METHOD
 // FL_REGEX_BASIC    Enable basic regular expressions (disabling extended RE).
 // FL_XDEV           Do not descend into directories that lead to other file
 //                   systems.
+// FL_ASYNC_STAT     Linux only: Stat directory entries in batches, using
+//                   asynchronous io_uring requests. Speeds up file systems with
+//                   high metadata latency, like NFS. Ignored if not supported.
+// FL_STATX_DONT_SYNC
+//                   Linux only: Allow network file systems to answer stat
+//                   requests from cached attributes without revalidating them
+//                   (AT_STATX_DONT_SYNC). Faster, but may act on outdated
+//                   information about changed files.
+// FL_BREADTH_FIRST  Traverse the directory tree level by level, so that files
+//                   closer to <dir> are found first (see struct fl_options's
+//                   member .max_matches). Parallel traversal is not used.
+// FL_STAT           Stat every file, to provide its stat information to
+//                   file_list_iter_next() (see struct fl_entry).
+// FL_IGNORE_FILES   Ignore files according to the rules of .gitignore and
+//                   .ignore files found in the directory tree (the latter
+//                   taking precedence). Ignored directories are not opened.
+// FL_UNIQUE_INODES  Report files with multiple hard links only once, by the
+//                   first path found (which may vary with parallel
+//                   traversal). Needs matching files except directories to
+//                   be stat'ed.
+// FL_UNIQUE_DIRS    Enter each directory only once, even if it can be reached
+//                   by multiple paths, e.g. via symbolic links with
+//                   FL_FOLLOW_LINKS. Other paths are skipped like loops.
+// FL_INODE_ORDER    Read each directory completely before stat'ing its
+//                   entries and descending into its subdirectories in
+//                   ascending inode order, which on many file systems (e.g.
+//                   ext4, XFS) matches their order on disk. Speeds up scans
+//                   with a cold cache on rotating disks. Sorted file lists are
+//                   the same. Parallel traversal and FL_ASYNC_STAT are not
+//                   used, and the flag is ignored with FL_BREADTH_FIRST.
 //
 // Values for parameter <FL_SORT_METHOD>:
 // FL_SORT_NONE     Do not sort the file list.
@@ -99,15 +312,264 @@ enum FL_SORT_METHOD
 ssize_t file_list_create(char ***file_list, int file_type, const char *regex,
     const char *dir, int depth, int flags, enum FL_SORT_METHOD);
 
-// Frees memory space previously allocated by create_file_list().
+// Same as file_list_create(), but a relative <dir> is interpreted relative to
+// the directory referred to by the file descriptor <dirfd> (which is not
+// closed) instead of the current working directory. If <dirfd> is AT_FDCWD
+// (from <fcntl.h>), the function behaves exactly like file_list_create().
+// The directory tree is traversed relative to each parent directory's open file
+// descriptor, so paths are not limited to PATH_MAX characters.
+ssize_t file_list_create_at(char ***file_list, int file_type,
+    const char *regex, int dirfd, const char *dir, int depth, int flags,
+    enum FL_SORT_METHOD);
+
+// Same as file_list_create_at(), but with additional settings that are passed
+// via <options> (see struct fl_options). <options> may be NULL. Limits that end
+// the traversal early are not errors: the files found so far are returned,
+// sorted as usual.
+ssize_t file_list_create_ex(char ***file_list, int file_type,
+    const char *regex, int dirfd, const char *dir, int depth, int flags,
+    enum FL_SORT_METHOD, const struct fl_options *options);
+
+// A file found by file_list_iter_next().
+struct fl_entry
+{
+    // The file's path. Valid until the next call of file_list_iter_next() or
+    // file_list_iter_close().
+    const char *path;
+
+    // The file's type: FL_BLK, FL_CHR, FL_DIR, FL_FIFO, FL_LNK, FL_REG,
+    // FL_SOCK, or FL_UNKNOWN.
+    int type;
+
+    // With flag FL_STAT, the file's stat information, otherwise NULL. Valid as
+    // long as <path>.
+    const struct stat *sb;
+
+    // False for directories that file_list_walk() passes only so that their
+    // subtrees can be skipped, although they don't match <file_type> and
+    // <regex>. Always true for file_list_iter_next().
+    bool matches;
+};
+
+// A directory tree iterator, created by file_list_iter_open().
+struct fl_iter;
+
+// Creates an iterator that finds the same files as file_list_create_ex(), but
+// returns them one by one while traversing the directory tree, instead of
+// collecting them in a file list first. The files are not sorted; directories
+// are returned before their contents. Memory usage depends on the tree's depth
+// only, not on the number of files. Parallel traversal (struct fl_options's
+// member .threads) is not used, and FL_BREADTH_FIRST is not supported.
+// On error, NULL is returned and errno is set to indicate the error.
+struct fl_iter *file_list_iter_open(int file_type, const char *regex,
+    int dirfd, const char *dir, int depth, int flags,
+    const struct fl_options *options);
+
+// Gets an iterator's next file.
+// Returns 1 if a file has been found and 0 if there are no more files. On
+// error, -1 is returned and errno is set to indicate the error; afterwards, the
+// iterator can only be closed.
+int file_list_iter_next(struct fl_iter *iter, struct fl_entry *entry);
+
+// Closes an iterator and frees its resources. <iter> may be NULL.
+void file_list_iter_close(struct fl_iter *iter);
+
+// Return values for callback functions of file_list_walk().
+enum FL_WALK_ACTION
+{
+    FL_WALK_CONTINUE,
+    FL_WALK_SKIP_SUBTREE,
+    FL_WALK_STOP,
+};
+
+// A callback function for file_list_walk(). <ctx> is file_list_walk()'s
+// parameter of the same name.
+typedef int (*fl_walk_fn)(const struct fl_entry *entry, void *ctx);
+
+// Traverses a directory tree like file_list_iter_open(), but calls <callback>
+// for each file that is found, instead of creating a file list. Directories are
+// passed before their contents. The callback's return value decides how the
+// traversal continues:
+// FL_WALK_CONTINUE      Continue normally.
+// FL_WALK_SKIP_SUBTREE  If <entry> is a directory, do not descend into it.
+// FL_WALK_STOP          Stop the traversal.
+// The callback is also called for each directory that is descended into but
+// doesn't match <file_type> and <regex>, with <entry->matches> set to false, so
+// that any subtree can be skipped.
+// On success, the number of callback calls is returned. On error, -1 is
+// returned and errno is set to indicate the error.
+ssize_t file_list_walk(int file_type, const char *regex, int dirfd,
+    const char *dir, int depth, int flags, fl_walk_fn callback, void *ctx,
+    const struct fl_options *options);
+
+// A file list in compact form, created by file_list_create_compact().
+struct fl_compact;
+
+// Creates a file list like file_list_create_ex(), but in compact form: each
+// file is stored as the 32-bit index of its parent directory and the offset of
+// its name, and each directory's name is stored only once, so that directory
+// prefixes are not repeated for every file. Paths are created on demand by
+// file_list_compact_path(). The files are in the order of
+// file_list_iter_open(), i.e. not sorted, with directories before their
+// contents. Parallel traversal (struct fl_options's member .threads) is not
+// used, and FL_BREADTH_FIRST is not supported.
+// On error, NULL is returned and errno is set to indicate the error. The errno
+// value EOVERFLOW means that the list would have more than UINT32_MAX files and
+// directories, or names of more than 4 GiB.
+struct fl_compact *file_list_create_compact(int file_type, const char *regex,
+    int dirfd, const char *dir, int depth, int flags,
+    const struct fl_options *options);
+
+// Returns the number of files in a compact file list.
+size_t file_list_compact_size(const struct fl_compact *list);
+
+// Writes the path of a compact file list's file <i> (which must be less than
+// the list's size) to <buf>, which has room for <size> bytes. Like snprintf(),
+// the path is truncated if it does not fit, and it is NUL-terminated unless
+// <size> is 0.
+// Returns the path's length, not counting the terminating NUL.
+size_t file_list_compact_path(const struct fl_compact *list, size_t i,
+    char *buf, size_t size);
+
+// Frees a compact file list. <list> may be NULL.
+void file_list_compact_destroy(struct fl_compact *list);
+
+// Creates an empty cache for struct fl_options's member .cache.
+// On error, NULL is returned and errno is set to indicate the error.
+struct fl_cache *file_list_cache_create(void);
+
+// Frees a cache. <cache> may be NULL.
+void file_list_cache_destroy(struct fl_cache *cache);
+
+// A file list that is kept up to date, created by file_list_watch_create().
+struct fl_watch;
+
+// Linux only: Creates a file list like file_list_create_ex(), then watches each
+// traversed directory for changes via inotify, so that the file list can be
+// kept up to date by calling file_list_watch_update() periodically. Relative
+// paths stay relative to <dirfd>, which is duplicated. FL_BREADTH_FIRST,
+// FL_FOLLOW_LINKS, FL_IGNORE_FILES, FL_UNIQUE_INODES, and FL_UNIQUE_DIRS are
+// not supported, and struct fl_options's members .threads, .max_matches,
+// .cache, .timeout, .max_entries, .cancel, .status, and .stats are ignored.
+// Each watched directory counts against the system's limit of inotify watches
+// (/proc/sys/fs/inotify/max_user_watches). Directories are watched via
+// /proc/self/fd; without /proc, <dir> has to be absolute or <dirfd> AT_FDCWD,
+// and paths longer than PATH_MAX can't be watched.
+// On error, NULL is returned and errno is set to indicate the error (ENOSYS if
+// inotify is not supported).
+struct fl_watch *file_list_watch_create(int file_type, const char *regex,
+    int dirfd, const char *dir, int depth, int flags, enum FL_SORT_METHOD,
+    const struct fl_options *options);
+
+// Returns the file descriptor of a watch's inotify instance, which becomes
+// readable (see poll()) when there are changes to apply.
+int file_list_watch_fd(const struct fl_watch *watch);
+
+// Returns a watch's file list, which is NULL-terminated and sorted according to
+// the watch's FL_SORT_METHOD, and saves its size in <n> if <n> is not NULL. The
+// list belongs to the watch and is valid until the next call of
+// file_list_watch_update() or file_list_watch_destroy().
+const char *const *file_list_watch_list(const struct fl_watch *watch,
+    size_t *n);
+
+// Applies all changes that have been reported since the watch has been created
+// or last updated, without blocking. Changed directories are read again, along
+// with new subdirectories, so that all changes of the same file are coalesced.
+// If <added> and <removed> are not NULL, they receive NULL-terminated lists of
+// the paths that have been added to and removed from the file list, in the
+// file list's sort order, which must be freed with file_list_destroy().
+// Returns the number of added and removed paths. On error, -1 is returned and
+// errno is set to indicate the error; the next update then reads the whole
+// directory tree again.
+ssize_t file_list_watch_update(struct fl_watch *watch, char ***added,
+    char ***removed);
+
+// Stops watching and frees a watch's resources. <watch> may be NULL.
+void file_list_watch_destroy(struct fl_watch *watch);
+
+// Frees a file list created by this library, like those of
+// file_list_create() and file_list_diff(), and sets it to NULL. The list's
+// paths are not freed one by one, but along with the few large memory blocks
+// they are allocated in. Paths that the caller has put into the list are freed
+// with free().
 void file_list_destroy(char ***file_list);
 
-// Merges two file lists by appending a copy of <source> to <destination> and
-// optionally sorting it.
+// Frees a file list's metadata arrays and sets them to NULL. <metadata>'s
+// member .fields is kept, so that the structure can be reused.
+void file_list_metadata_free(struct fl_metadata *metadata);
+
+// Merges two file lists by appending the files of <source> to <destination>
+// and optionally sorting it. The destination takes over the source's paths,
+// along with the memory blocks they are allocated in, the source's array is
+// freed, and <*source> is set to NULL. Both lists must have been created by
+// this library.
 // Specifying the lists' sizes is faster but optional (0 meaning unspecified).
 // On error, -1 is returned, errno is set to indicate the error, and the
 // destination list remains unchanged.
 ssize_t file_list_merge(char ***destination, size_t n_dest,
     const char ***source, size_t n_source, enum FL_SORT_METHOD);
 
+// A file list that has been loaded by file_list_open_snapshot(). All members
+// are read-only.
+struct fl_snapshot
+{
+    // The NULL-terminated file list. Its strings are not allocated one by one,
+    // but point into the mapped snapshot file.
+    const char *const *file_list;
+
+    // The number of files.
+    size_t n;
+
+    // The directory the file list has been created from, or NULL if unknown.
+    const char *root;
+
+    // The sort method the file list has been sorted with.
+    enum FL_SORT_METHOD sort_method;
+
+    // When the snapshot has been saved.
+    time_t time;
+};
+
+// Saves a file list as a snapshot file, which file_list_open_snapshot() can map
+// into memory without parsing it. The file consists of a header with a format
+// version, <root>, and <FL_SORT_METHOD> (as metadata only; the file list is not
+// sorted), followed by a table of offsets and the strings themselves. It does
+// not depend on where it is mapped, but on the machine's byte order. <path> is
+// replaced atomically, so that processes that have mapped the old file are not
+// affected, once the new file has been synced to disk. Its mode is 0666 minus
+// the umask, like with open(). <root> may be NULL. Specifying the list's size
+// <n> is faster but optional (0 meaning unspecified).
+// On error, -1 is returned and errno is set to indicate the error.
+int file_list_save(char *const *file_list, size_t n, const char *root,
+    enum FL_SORT_METHOD, const char *path);
+
+// Maps a snapshot file saved by file_list_save() into memory. Apart from the
+// file list's array of pointers, nothing is allocated, so even huge file lists
+// are loaded quickly.
+// On error, NULL is returned and errno is set to indicate the error (EINVAL if
+// the file is not a valid snapshot file of the same format version and byte
+// order).
+struct fl_snapshot *file_list_open_snapshot(const char *path);
+
+// Unmaps a snapshot and frees its resources. <snapshot> may be NULL.
+void file_list_close_snapshot(struct fl_snapshot *snapshot);
+
+// Compares two file lists that have been sorted with the same FL_SORT_METHOD
+// other than FL_SORT_NONE, like those of snapshots and watches. Lists from
+// file_list_create() need to be cast to (const char *const *).
+// If <added> and <removed> are not NULL, they receive NULL-terminated lists of
+// the paths that are only in <new_list> and only in <old_list>, respectively,
+// in sort order, which must be freed with file_list_destroy().
+// If <old_meta> and <new_meta>, the lists' metadata from file_list_create_ex(),
+// are not NULL, paths in both lists are modified if any field captured for both
+// differs, and if <modified> is not NULL, it receives a list of these paths
+// like <added>.
+// Specifying the lists' sizes is faster but optional (0 meaning unspecified).
+// Returns the number of added, removed, and modified paths. On error, -1 is
+// returned and errno is set to indicate the error.
+ssize_t file_list_diff(const char *const *old_list, size_t n_old,
+    const struct fl_metadata *old_meta, const char *const *new_list,
+    size_t n_new, const struct fl_metadata *new_meta, enum FL_SORT_METHOD,
+    char ***added, char ***removed, char ***modified);
+
 #endif